@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "defs.h"
+#include "interface.h"
+#include "model.h"
+#include "snapshot.h"
+
+// Compares the specialized formula evaluators with the generic interpreter by
+// recalculating a sheet with a representative mix of formulas many times.
+//
+// Each row holds an input number, then formulas of the shapes seen most often:
+//   B: =A1          (alias)
+//   C: =A1+B1       (two references)
+//   D: =C1+0.2      (reference plus constant)
+//   E: =1+2         (constant)
+//   F: =A1+B1+C1+D1+1  (generic, with folding)
+//   G: =F1+E1+0.5+0.25 (two references, constants folded)
+
+#define DEFAULT_ITERATIONS 200000
+
+static double time_recalculation(long iterations) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < iterations; i++)
+        recalculate_all();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void copy_values(double values[NUM_ROWS][NUM_COLS]) {
+    int reader = snapshot_register_reader();
+    const Snapshot *snapshot = snapshot_acquire(reader, 0);
+    memcpy(values, snapshot->values, sizeof(snapshot->values));
+    snapshot_release(reader);
+    snapshot_unregister_reader(reader);
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations < 1) {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 2;
+    }
+
+    model_init();
+    const char *formulas[] = {"=A%d", "=A%d+B%d", "=C%d+0.2", "=1+2", "=A%d+B%d+C%d+D%d+1", "=F%d+E%d+0.5+0.25"};
+    char text[64];
+    for (int row = 0; row < NUM_ROWS; row++) {
+        snprintf(text, sizeof(text), "%d.5", row + 1);
+        set_cell_value(row, COL_A, strdup(text));
+        for (int col = COL_B; col <= COL_G; col++) {
+            int r = row + 1;
+            snprintf(text, sizeof(text), formulas[col - COL_B], r, r, r, r);
+            set_cell_value(row, col, strdup(text));
+        }
+    }
+
+    double generic_values[NUM_ROWS][NUM_COLS], specialized_values[NUM_ROWS][NUM_COLS];
+    set_formula_specialization(false);
+    recalculate_all();
+    copy_values(generic_values);
+    double generic = time_recalculation(iterations);
+
+    set_formula_specialization(true);
+    recalculate_all();
+    copy_values(specialized_values);
+    double specialized = time_recalculation(iterations);
+
+    // Folding reorders additions, so allow for rounding differences.
+    for (int row = 0; row < NUM_ROWS; row++) {
+        for (int col = 0; col < NUM_COLS; col++) {
+            double difference = generic_values[row][col] - specialized_values[row][col];
+            if (difference > 1e-9 || difference < -1e-9) {
+                fprintf(stderr, "Results differ at %c%d\n", 'A' + col, row + 1);
+                return 1;
+            }
+        }
+    }
+
+    int formulas_per_pass = NUM_ROWS * (NUM_COLS - 1);
+    double evaluations = (double) iterations * formulas_per_pass;
+    printf("%ld recalculations of %d formulas\n", iterations, formulas_per_pass);
+    printf("generic:     %.3f s, %.1f ns per formula\n", generic, generic / evaluations * 1e9);
+    printf("specialized: %.3f s, %.1f ns per formula\n", specialized, specialized / evaluations * 1e9);
+    printf("speedup:     %.2fx\n", generic / specialized);
+    return 0;
+}
+
+void update_cell_display(ROW row, COL col, const char *text) {
+    (void) row;
+    (void) col;
+    (void) text;
+}
@@ -0,0 +1,96 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Forwards standard input to spreadsheetd and prints everything it sends back.
+// Requests can be piped in; the client exits once the server has answered them
+// all and closed the connection.
+
+static int connect_to(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t amount = write(fd, buffer, length);
+        if (amount < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += amount;
+        length -= amount;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = DEFAULT_SOCKET_PATH;
+    int option;
+    while ((option = getopt(argc, argv, "s:")) != -1) {
+        switch (option) {
+            case 's':
+                path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s socket_path] < requests\n", argv[0]);
+                return 2;
+        }
+    }
+
+    int fd = connect_to(path);
+    if (fd < 0)
+        return 1;
+
+    char buffer[MAX_LINE_LENGTH];
+    struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN}, {.fd = fd, .events = POLLIN}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+        if (fds[0].revents) {
+            ssize_t amount = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (amount <= 0) {
+                // No more requests; keep reading until the server is done.
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+            } else if (write_all(fd, buffer, amount) < 0) {
+                perror("write");
+                return 1;
+            }
+        }
+        if (fds[1].revents) {
+            ssize_t amount = read(fd, buffer, sizeof(buffer));
+            if (amount <= 0)
+                break;
+            if (write_all(STDOUT_FILENO, buffer, amount) < 0)
+                return 1;
+        }
+    }
+    close(fd);
+    return 0;
+}
@@ -29,4 +29,13 @@ typedef enum {
     COL_G,
 } COL;
 
+// Errors a formula can evaluate to. Any formula referencing a cell with an
+// error evaluates to the same error.
+typedef enum {
+    ERROR_NONE,
+    ERROR_REF, // "#REF!": reference outside the sheet or to a deleted cell
+    ERROR_VALUE, // "#VALUE!": reference to a text cell
+    ERROR_CIRC, // "#CIRC!": circular reference
+} CELL_ERROR;
+
 #endif //ASSIGNMENT_DEFS_H
@@ -0,0 +1,61 @@
+#include "diagnostics.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+static char messages[DIAGNOSTICS_CAPACITY][DIAGNOSTIC_LENGTH];
+static int first = 0;
+static int count = 0;
+static unsigned long dropped = 0;
+
+// Second the rate limit is currently counting, and messages recorded in it.
+static time_t window = 0;
+static int recorded_in_window = 0;
+
+void diagnostic(const char *format, ...) {
+    time_t now = time(NULL);
+    if (now != window) {
+        window = now;
+        recorded_in_window = 0;
+    }
+    if (recorded_in_window >= DIAGNOSTICS_PER_SECOND) {
+        dropped++;
+        return;
+    }
+    recorded_in_window++;
+
+    // Overwrite the oldest message once the buffer is full.
+    int slot = (first + count) % DIAGNOSTICS_CAPACITY;
+    if (count == DIAGNOSTICS_CAPACITY) {
+        first = (first + 1) % DIAGNOSTICS_CAPACITY;
+        dropped++;
+    } else {
+        count++;
+    }
+
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(messages[slot], DIAGNOSTIC_LENGTH, format, arguments);
+    va_end(arguments);
+}
+
+int diagnostics_count() {
+    return count;
+}
+
+const char *diagnostics_get(int index) {
+    if (index < 0 || index >= count)
+        return NULL;
+    return messages[(first + index) % DIAGNOSTICS_CAPACITY];
+}
+
+unsigned long diagnostics_dropped() {
+    return dropped;
+}
+
+void diagnostics_clear() {
+    first = 0;
+    count = 0;
+    dropped = 0;
+}
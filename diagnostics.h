@@ -0,0 +1,32 @@
+#ifndef ASSIGNMENT_DIAGNOSTICS_H
+#define ASSIGNMENT_DIAGNOSTICS_H
+
+// Buffered, rate-limited channel for warnings and errors from the model.
+//
+// Messages are kept in memory, newest replacing oldest, instead of being
+// written anywhere; the program decides whether and where to show them. At most
+// DIAGNOSTICS_PER_SECOND messages are recorded per second; the rest are only
+// counted, without being formatted.
+
+#define DIAGNOSTICS_CAPACITY 64
+#define DIAGNOSTICS_PER_SECOND 16
+#define DIAGNOSTIC_LENGTH 128
+
+// Records a message, formatted like printf.
+void diagnostic(const char *format, ...);
+
+// Returns the number of buffered messages.
+int diagnostics_count();
+
+// Returns a buffered message, oldest first. The string stays valid until the
+// next call to 'diagnostic' or 'diagnostics_clear'.
+const char *diagnostics_get(int index);
+
+// Returns the number of messages dropped by the rate limit or because the
+// buffer was full, since the last 'diagnostics_clear'.
+unsigned long diagnostics_dropped();
+
+// Removes all buffered messages and resets the dropped count.
+void diagnostics_clear();
+
+#endif //ASSIGNMENT_DIAGNOSTICS_H
@@ -16,6 +16,32 @@ static COL cur_col = COL_A;
 // Column to return to when pressing <enter>.
 static COL return_col = COL_A;
 
+// Top-left cell of the viewport and the number of rows/columns it shows.
+static ROW view_row = ROW_1;
+static COL view_col = COL_A;
+static int view_rows = 0;
+static int view_cols = 0;
+
+// Size of the drawn grid, in console characters.
+static size_t total_width = 0;
+static size_t total_height = 0;
+
+// String of blanks at least as wide as the console.
+static char *blanks = NULL;
+
+// Visible cells whose text changed since the last repaint. The model only
+// reports cells inside the viewport; the others are fetched when scrolled into
+// view.
+static struct {
+    ROW row;
+    COL col;
+} damage[NUM_ROWS * NUM_COLS];
+static size_t damage_count = 0;
+static bool damaged[NUM_ROWS][NUM_COLS];
+
+// Set when the whole viewport has to be redrawn (scrolling, resizing).
+static bool needs_full_redraw = true;
+
 // Current editable text.
 static char *edit_text = NULL;
 static size_t edit_text_capacity = 0;
@@ -23,9 +49,20 @@ static size_t edit_text_length = 0;
 static size_t edit_position = 0;
 static size_t edit_display_offset = 0;
 
+static int console_row_of(ROW row) {
+    return 2 * ((int) row - (int) view_row + 2) + 1;
+}
+
+static int console_col_of(COL col) {
+    return (CELL_DISPLAY_WIDTH + 1) * ((int) col - (int) view_col + 1) + 1;
+}
+
+static bool is_visible(ROW row, COL col) {
+    return row >= view_row && row < view_row + view_rows && col >= view_col && col < view_col + view_cols;
+}
+
 static void set_cell_attr(attr_t attr) {
-    mvchgat(2 * ((int) cur_row + 2) + 1, (CELL_DISPLAY_WIDTH + 1) * (cur_col + 1) + 1, CELL_DISPLAY_WIDTH, attr, 0,
-            NULL);
+    mvchgat(console_row_of(cur_row), console_col_of(cur_col), CELL_DISPLAY_WIDTH, attr, 0, NULL);
 }
 
 static void ensure_edit_text_capacity(size_t capacity) {
@@ -47,42 +84,86 @@ static void ensure_edit_text_capacity(size_t capacity) {
     edit_text_capacity = capacity;
 }
 
-int main() {
-    /* INITIALIZATION */
-
-    // Initialize NCURSES.
-    initscr();
-
-    // Enable raw characters for control sequences.
-    raw();
-
-    // Disable automatic echo of typed characters.
-    noecho();
-
-    // Enable input of function keys.
-    keypad(stdscr, true);
+static void draw_cell(ROW row, COL col) {
+    char text[CELL_DISPLAY_WIDTH + 1];
+    get_display_text(row, col, text, sizeof(text));
+    mvaddnstr(console_row_of(row), console_col_of(col), blanks, CELL_DISPLAY_WIDTH);
+    mvaddnstr(console_row_of(row), console_col_of(col), text, CELL_DISPLAY_WIDTH);
+}
 
-    /* DRAW BORDERS */
+// Fits the viewport to the size of the console.
+static void layout_viewport() {
+    int lines, columns;
+    getmaxyx(stdscr, lines, columns);
+
+    // Leave one column for the row headers and two rows for the edit field and
+    // column headers, plus the exit instructions and sheet name below the grid.
+    view_cols = (columns - 1) / (CELL_DISPLAY_WIDTH + 1) - 1;
+    view_rows = (lines - 3) / 2 - 2;
+    if (view_cols > NUM_COLS)
+        view_cols = NUM_COLS;
+    if (view_cols < 1)
+        view_cols = 1;
+    if (view_rows > NUM_ROWS)
+        view_rows = NUM_ROWS;
+    if (view_rows < 1)
+        view_rows = 1;
+
+    total_width = (view_cols + 1) * (CELL_DISPLAY_WIDTH + 1) + 1;
+    total_height = (view_rows + 2) * 2 + 1;
+
+    free(blanks);
+    size_t blanks_width = total_width > (size_t) columns ? total_width : (size_t) columns;
+    blanks = malloc(blanks_width + 1);
+    if (blanks == NULL) {
+        endwin();
+        exit(ENOMEM);
+    }
+    memset(blanks, ' ', blanks_width);
+    blanks[blanks_width] = 0;
+
+    if ((int) view_row > NUM_ROWS - view_rows)
+        view_row = NUM_ROWS - view_rows;
+    if ((int) view_col > NUM_COLS - view_cols)
+        view_col = NUM_COLS - view_cols;
+    set_display_window(view_row, view_col, view_rows, view_cols);
+    needs_full_redraw = true;
+}
 
-    // Include extra column to the left for cur_row numbers.
-    const size_t total_width = (NUM_COLS + 1) * (CELL_DISPLAY_WIDTH + 1) + 1;
-    // Include two extra rows on top for edit field and cur_row numbers.
-    const size_t total_height = (NUM_ROWS + 2) * 2 + 1;
+// Scrolls the viewport so that the current cell is visible.
+static void scroll_to_cursor() {
+    ROW old_row = view_row;
+    COL old_col = view_col;
+    if (cur_row < view_row)
+        view_row = cur_row;
+    else if (cur_row >= view_row + view_rows)
+        view_row = cur_row - view_rows + 1;
+    if (cur_col < view_col)
+        view_col = cur_col;
+    else if (cur_col >= view_col + view_cols)
+        view_col = cur_col - view_cols + 1;
+    if (view_row != old_row || view_col != old_col) {
+        set_display_window(view_row, view_col, view_rows, view_cols);
+        needs_full_redraw = true;
+    }
+}
 
-    // Resize window.
-    resizeterm(total_height + 1, total_width);
+// Draws borders, headers and every visible cell.
+static void draw_viewport() {
+    erase();
 
     // Draw the top line.
+    move(0, 0);
     addch(ACS_ULCORNER);
     for (size_t i = 0; i < total_width - 2; i++)
         addch(ACS_HLINE);
     addch(ACS_URCORNER);
 
     // Draw the left/right and interior lines.
-    for (size_t i = 0; i < NUM_ROWS + 2; i++) {
+    for (size_t i = 0; i < (size_t) view_rows + 2; i++) {
         if (i > 0) {
             mvaddch(2 * i, 0, ACS_LTEE);
-            for (size_t j = 0; j < NUM_COLS + 1; j++) {
+            for (size_t j = 0; j < (size_t) view_cols + 1; j++) {
                 if (j > 0)
                     addch(i == 1 ? ACS_TTEE : ACS_PLUS);
                 for (size_t k = 0; k < CELL_DISPLAY_WIDTH; k++)
@@ -92,14 +173,14 @@ int main() {
         }
         mvaddch(2 * i + 1, 0, ACS_VLINE);
         if (i > 0)
-            for (size_t j = 1; j < NUM_COLS + 1; j++)
+            for (size_t j = 1; j < (size_t) view_cols + 1; j++)
                 mvaddch(2 * i + 1, (CELL_DISPLAY_WIDTH + 1) * j, ACS_VLINE);
         mvaddch(2 * i + 1, total_width - 1, ACS_VLINE);
     }
 
     // Draw the bottom line.
     mvaddch(total_height - 1, 0, ACS_LLCORNER);
-    for (size_t i = 0; i < NUM_COLS + 1; i++) {
+    for (size_t i = 0; i < (size_t) view_cols + 1; i++) {
         if (i > 0)
             addch(ACS_BTEE);
         for (size_t j = 0; j < CELL_DISPLAY_WIDTH; j++)
@@ -108,38 +189,79 @@ int main() {
     addch(ACS_LRCORNER);
 
     // Draw exit instructions.
-    mvaddstr(total_height, 0, "Press Ctrl+C to exit.");
-
-    /* HEADERS */
+    mvaddstr(total_height, 0, "Press Ctrl+C to exit, F5/F6 to switch sheets, F7 to add a sheet.");
 
     // Print the column headers.
-    for (COL col = COL_A; col < NUM_COLS; col++)
-        mvaddch(3, (CELL_DISPLAY_WIDTH + 1) * (col + 1) + CELL_DISPLAY_WIDTH / 2 + 1, col + 'A');
+    for (COL col = view_col; col < view_col + view_cols; col++)
+        mvaddch(3, console_col_of(col) + CELL_DISPLAY_WIDTH / 2, col + 'A');
 
     // Generate the format specifier for the cur_row headers.
     char format_buffer[8];
     snprintf(format_buffer, sizeof(format_buffer), "%%%dd", CELL_DISPLAY_WIDTH);
 
     // Print the cur_row headers.
-    for (ROW row = ROW_1; row < NUM_ROWS; row++)
-        mvprintw(2 * ((int) row + 2) + 1, 1, format_buffer, row + 1);
+    for (ROW row = view_row; row < view_row + view_rows; row++)
+        mvprintw(console_row_of(row), 1, format_buffer, row + 1);
+
+    // Print the visible cells.
+    for (ROW row = view_row; row < view_row + view_rows; row++)
+        for (COL col = view_col; col < view_col + view_cols; col++)
+            draw_cell(row, col);
+}
+
+// Brings the console up to date with the model. Only damaged cells are
+// repainted unless the viewport moved.
+static void repaint() {
+    if (needs_full_redraw) {
+        draw_viewport();
+        needs_full_redraw = false;
+    } else {
+        for (size_t i = 0; i < damage_count; i++)
+            if (is_visible(damage[i].row, damage[i].col))
+                draw_cell(damage[i].row, damage[i].col);
+    }
+    for (size_t i = 0; i < damage_count; i++)
+        damaged[damage[i].row][damage[i].col] = false;
+    damage_count = 0;
+}
+
+int main() {
+    /* INITIALIZATION */
+
+    // Initialize NCURSES.
+    initscr();
+
+    // Enable raw characters for control sequences.
+    raw();
+
+    // Disable automatic echo of typed characters.
+    noecho();
+
+    // Enable input of function keys.
+    keypad(stdscr, true);
 
     /* MAIN LOOP */
 
     // Initialize data structure.
     model_init();
 
-    // String of blanks used by main loop.
-    char blanks[total_width + 1];
-    for (size_t i = 0; i < total_width; i++)
-        blanks[i] = ' ';
-    blanks[total_width] = 0;
+    // Fit the viewport to the console.
+    layout_viewport();
 
     while (true) {
+        // Bring the viewport up to date.
+        scroll_to_cursor();
+        repaint();
+
         // Print the current cell coordinates in top-left corner.
         mvaddnstr(3, 1, blanks, CELL_DISPLAY_WIDTH);
         mvprintw(3, CELL_DISPLAY_WIDTH / 2, "%c%d", cur_col + 'A', cur_row + 1);
 
+        // Print the name of the active sheet under the instructions.
+        move(total_height + 1, 0);
+        clrtoeol();
+        mvprintw(total_height + 1, 0, "Sheet: %s (%d of %d)", sheet_name(active_sheet()), active_sheet() + 1, sheet_count());
+
         // Show the textual representation of the current cell in the edit field.
         if (edit_text != NULL)
             free(edit_text);
@@ -164,6 +286,9 @@ int main() {
             case 3: // Ctrl+C
                 endwin();
                 return 0;
+            case KEY_RESIZE:
+                layout_viewport();
+                continue;
             case KEY_UP:
                 if (cur_row > ROW_1)
                     cur_row--;
@@ -203,6 +328,26 @@ int main() {
             case KEY_DC:
                 clear_cell(cur_row, cur_col);
                 continue;
+            case KEY_F(5):
+                if (active_sheet() > 0)
+                    activate_sheet(active_sheet() - 1);
+                continue;
+            case KEY_F(6):
+                if (active_sheet() < sheet_count() - 1)
+                    activate_sheet(active_sheet() + 1);
+                continue;
+            case KEY_F(7): {
+                // Name the new sheet after its position, skipping names in use.
+                char name[SHEET_NAME_LENGTH];
+                int number = sheet_count() + 1;
+                do
+                    snprintf(name, sizeof(name), "Sheet%d", number++);
+                while (find_sheet(name) >= 0);
+                int sheet = add_sheet(name);
+                if (sheet >= 0)
+                    activate_sheet(sheet);
+                continue;
+            }
             case '\n':
                 if (cur_row < NUM_ROWS - 1) {
                     cur_row++;
@@ -314,12 +459,12 @@ int main() {
 }
 
 void update_cell_display(ROW row, COL col, const char *text) {
-    int console_row = 2 * ((int) row + 2) + 1;
-    int console_col = (CELL_DISPLAY_WIDTH + 1) * (col + 1) + 1;
-    char blanks[CELL_DISPLAY_WIDTH + 1];
-    for (size_t i = 0; i < CELL_DISPLAY_WIDTH; i++)
-        blanks[i] = ' ';
-    blanks[CELL_DISPLAY_WIDTH] = '\0';
-    mvaddstr(console_row, console_col, blanks);
-    mvaddnstr(console_row, console_col, text, CELL_DISPLAY_WIDTH);
+    (void) text; // Fetched again when the cell is repainted
+    // Off-screen cells are fetched when they are scrolled into view.
+    if (!is_visible(row, col) || damaged[row][col])
+        return;
+    damaged[row][col] = true;
+    damage[damage_count].row = row;
+    damage[damage_count].col = col;
+    damage_count++;
 }
@@ -0,0 +1,735 @@
+#include "journal.h"
+#include "diagnostics.h"
+#include "model.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define fdatasync _commit
+#define fsync _commit
+static ssize_t pread(int fd, void *data, size_t length, off_t offset) {
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    return read(fd, data, length);
+}
+#endif
+
+// Kinds of records.
+enum {
+    JOURNAL_SET = 1,
+    JOURNAL_CLEAR = 2,
+    JOURNAL_CHECKPOINT = 3, // First record of a snapshot; carries its sequence number.
+    JOURNAL_INSERT_ROW = 4,
+    JOURNAL_DELETE_ROW = 5,
+    JOURNAL_INSERT_COL = 6,
+    JOURNAL_DELETE_COL = 7,
+    JOURNAL_SORT_ROWS = 8, // Row is the first row, col the key; text is "<last row> <1 if ascending>".
+    JOURNAL_ADD_SHEET = 9, // Text is the name of the new sheet.
+    JOURNAL_ACTIVATE_SHEET = 10, // Text is the name of the sheet later records apply to.
+    JOURNAL_DIRECTORY = 11, // Last record of a snapshot; text is a "<offset> <length> <name>" line per sheet.
+    JOURNAL_ADD_PIVOT = 12, // Text is "<first> <last> <key> <value> <function> <target row> <target col>".
+    JOURNAL_REMOVE_PIVOT = 13, // Row and col are the target of the pivot.
+};
+
+// Size of a record without its text.
+#define RECORD_HEADER_SIZE (4 + 8 + 1 + 2 + 2 + 4)
+
+typedef struct {
+    unsigned char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+typedef struct {
+    uint64_t sequence;
+    uint8_t op;
+    uint16_t row;
+    uint16_t col;
+    const unsigned char *text;
+    uint32_t text_length;
+} Record;
+
+// Where the SET records of a sheet are in the snapshot file. An empty section
+// is a blank sheet.
+typedef struct {
+    off_t offset;
+    size_t length;
+} Section;
+
+static int journal_fd = -1;
+static char *journal_path = NULL;
+static char *snapshot_path = NULL;
+static unsigned commit_interval_ms = 0;
+static unsigned long checkpoint_records = 0;
+static unsigned long records_since_checkpoint = 0;
+static uint64_t next_sequence = 1;
+static struct timespec last_commit;
+
+// Set while replaying, so that replayed edits are not journaled again.
+static bool replaying = false;
+
+// Records waiting for the next group commit.
+static Buffer pending = {NULL, 0, 0};
+
+// The snapshot stays open so that sheets can be loaded from it when first used.
+static int snapshot_fd = -1;
+static Section sections[MAX_SHEETS];
+
+static uint32_t crc_table[256];
+
+static uint32_t crc32(const unsigned char *data, size_t length) {
+    if (crc_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            crc_table[i] = crc;
+        }
+    }
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < length; i++)
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Grows 'buffer' to hold at least 'needed' bytes.
+static bool reserve(Buffer *buffer, size_t needed) {
+    if (needed > buffer->capacity) {
+        size_t capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity;
+        while (capacity < needed)
+            capacity *= 2;
+        unsigned char *grown = realloc(buffer->data, capacity);
+        if (grown == NULL)
+            return false;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    return true;
+}
+
+static bool append_bytes(Buffer *buffer, const void *data, size_t length) {
+    if (!reserve(buffer, buffer->length + length))
+        return false;
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+static bool append_record(Buffer *buffer, uint64_t sequence, uint8_t op, ROW row, COL col, const char *text) {
+    uint32_t text_length = text == NULL ? 0 : (uint32_t) strlen(text);
+    size_t needed = buffer->length + RECORD_HEADER_SIZE + text_length;
+    if (!reserve(buffer, needed))
+        return false;
+
+    unsigned char *record = buffer->data + buffer->length;
+    uint16_t row_field = (uint16_t) row;
+    uint16_t col_field = (uint16_t) col;
+    memcpy(record + 4, &sequence, 8);
+    record[12] = op;
+    memcpy(record + 13, &row_field, 2);
+    memcpy(record + 15, &col_field, 2);
+    memcpy(record + 17, &text_length, 4);
+    if (text_length > 0)
+        memcpy(record + RECORD_HEADER_SIZE, text, text_length);
+    uint32_t crc = crc32(record + 4, RECORD_HEADER_SIZE - 4 + text_length);
+    memcpy(record, &crc, 4);
+    buffer->length = needed;
+    return true;
+}
+
+// Parses the record at 'offset' in 'data'. Returns false if it is torn or corrupt.
+static bool parse_record(const unsigned char *data, size_t length, size_t offset, Record *record) {
+    if (length - offset < RECORD_HEADER_SIZE)
+        return false;
+    const unsigned char *start = data + offset;
+    uint32_t crc;
+    memcpy(&crc, start, 4);
+    memcpy(&record->sequence, start + 4, 8);
+    record->op = start[12];
+    memcpy(&record->row, start + 13, 2);
+    memcpy(&record->col, start + 15, 2);
+    memcpy(&record->text_length, start + 17, 4);
+    record->text = start + RECORD_HEADER_SIZE;
+    return record->text_length <= length - offset - RECORD_HEADER_SIZE &&
+           crc32(start + 4, RECORD_HEADER_SIZE - 4 + record->text_length) == crc;
+}
+
+// Returns a malloc'd, null-terminated copy of the text of a record.
+static char *record_text(const Record *record) {
+    char *text = malloc(record->text_length + 1);
+    if (text != NULL) {
+        memcpy(text, record->text, record->text_length);
+        text[record->text_length] = 0;
+    }
+    return text;
+}
+
+static bool read_at(int fd, off_t offset, void *data, size_t length) {
+    unsigned char *position = data;
+    while (length > 0) {
+        ssize_t amount = pread(fd, position, length, offset);
+        if (amount <= 0)
+            return false;
+        position += amount;
+        offset += amount;
+        length -= amount;
+    }
+    return true;
+}
+
+// Reads and parses the record of the snapshot at 'offset', which must end before 'end'.
+static bool read_snapshot_record(off_t offset, off_t end, Buffer *buffer, Record *record) {
+    uint32_t text_length;
+    if (end - offset < RECORD_HEADER_SIZE || !reserve(buffer, RECORD_HEADER_SIZE) ||
+        !read_at(snapshot_fd, offset, buffer->data, RECORD_HEADER_SIZE))
+        return false;
+    memcpy(&text_length, buffer->data + 17, 4);
+    if (text_length > (uint64_t) (end - offset - RECORD_HEADER_SIZE) || !reserve(buffer, RECORD_HEADER_SIZE + text_length) ||
+        !read_at(snapshot_fd, offset + RECORD_HEADER_SIZE, buffer->data + RECORD_HEADER_SIZE, text_length))
+        return false;
+    buffer->length = RECORD_HEADER_SIZE + text_length;
+    return parse_record(buffer->data, buffer->length, 0, record);
+}
+
+static bool write_all(int fd, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        ssize_t amount = write(fd, data, length);
+        if (amount < 0 && errno == EINTR)
+            continue;
+        if (amount < 0)
+            return false;
+        data += amount;
+        length -= amount;
+    }
+    return true;
+}
+
+// Makes a created or renamed file's directory entry durable.
+static void sync_directory(const char *path) {
+#ifndef _WIN32
+    char *directory = strdup(path);
+    if (directory == NULL)
+        return;
+    char *slash = strrchr(directory, '/');
+    if (slash == NULL)
+        strcpy(directory, ".");
+    else if (slash == directory)
+        slash[1] = 0;
+    else
+        *slash = 0;
+    int fd = open(directory, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(directory);
+#else
+    (void) path;
+#endif
+}
+
+// Reads a whole file into memory. A missing file reads as empty.
+static bool read_file(int fd, Buffer *buffer) {
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    while (true) {
+        if (buffer->length == buffer->capacity) {
+            size_t capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity * 2;
+            unsigned char *grown = realloc(buffer->data, capacity);
+            if (grown == NULL)
+                return false;
+            buffer->data = grown;
+            buffer->capacity = capacity;
+        }
+        ssize_t amount = read(fd, buffer->data + buffer->length, buffer->capacity - buffer->length);
+        if (amount < 0)
+            return false;
+        if (amount == 0)
+            return true;
+        buffer->length += amount;
+    }
+}
+
+static bool parse_pivot(const unsigned char *text, uint32_t text_length, PivotSpec *spec) {
+    char arguments[64];
+    int values[7];
+    size_t length = text_length < sizeof(arguments) - 1 ? text_length : sizeof(arguments) - 1;
+    memcpy(arguments, text, length);
+    arguments[length] = 0;
+    if (sscanf(arguments, "%d %d %d %d %d %d %d", &values[0], &values[1], &values[2], &values[3], &values[4],
+               &values[5], &values[6]) != 7)
+        return false;
+    *spec = (PivotSpec) {(ROW) values[0], (ROW) values[1], (COL) values[2], (COL) values[3],
+                         (PIVOT_FUNCTION) values[4], (ROW) values[5], (COL) values[6]};
+    return true;
+}
+
+static void format_pivot(const PivotSpec *spec, char *arguments, size_t size) {
+    snprintf(arguments, size, "%d %d %d %d %d %d %d", (int) spec->first, (int) spec->last, (int) spec->key,
+             (int) spec->value, (int) spec->function, (int) spec->target_row, (int) spec->target_col);
+}
+
+static void replay_structural(uint8_t op, ROW row, COL col, const unsigned char *text, uint32_t text_length) {
+    switch (op) {
+        case JOURNAL_INSERT_ROW:
+            insert_row(row);
+            break;
+        case JOURNAL_DELETE_ROW:
+            delete_row(row);
+            break;
+        case JOURNAL_INSERT_COL:
+            insert_col(col);
+            break;
+        case JOURNAL_DELETE_COL:
+            delete_col(col);
+            break;
+        case JOURNAL_ADD_SHEET:
+        case JOURNAL_ACTIVATE_SHEET: {
+            char name[SHEET_NAME_LENGTH];
+            size_t length = text_length < sizeof(name) - 1 ? text_length : sizeof(name) - 1;
+            memcpy(name, text, length);
+            name[length] = 0;
+            if (op == JOURNAL_ADD_SHEET)
+                add_sheet(name);
+            else
+                activate_sheet(find_sheet(name));
+            break;
+        }
+        case JOURNAL_ADD_PIVOT: {
+            PivotSpec spec;
+            if (parse_pivot(text, text_length, &spec))
+                add_pivot(&spec);
+            break;
+        }
+        case JOURNAL_REMOVE_PIVOT:
+            remove_pivot(row, col);
+            break;
+        default: {
+            char arguments[32];
+            int last, ascending;
+            size_t length = text_length < sizeof(arguments) - 1 ? text_length : sizeof(arguments) - 1;
+            memcpy(arguments, text, length);
+            arguments[length] = 0;
+            if (sscanf(arguments, "%d %d", &last, &ascending) == 2)
+                sort_rows(row, (ROW) last, col, ascending != 0);
+            break;
+        }
+    }
+}
+
+// Applies the records in 'buffer' with a sequence number above 'after'.
+//
+// Stops at the first torn or corrupt record and stores the length of the valid
+// prefix in 'valid_length'. Returns the number of records applied.
+static long replay(const Buffer *buffer, uint64_t after, uint64_t *last_sequence, size_t *valid_length) {
+    long applied = 0;
+    size_t offset = 0;
+    Record record;
+    while (parse_record(buffer->data, buffer->length, offset, &record)) {
+        ROW row = (ROW) record.row;
+        COL col = (COL) record.col;
+        if (record.sequence > after && record.row < NUM_ROWS && record.col < NUM_COLS) {
+            if (record.op == JOURNAL_SET) {
+                char *text = record_text(&record);
+                if (text == NULL)
+                    break;
+                set_cell_value(row, col, text);
+                applied++;
+            } else if (record.op == JOURNAL_CLEAR) {
+                clear_cell(row, col);
+                applied++;
+            } else if ((record.op >= JOURNAL_INSERT_ROW && record.op <= JOURNAL_ACTIVATE_SHEET) ||
+                       record.op == JOURNAL_ADD_PIVOT || record.op == JOURNAL_REMOVE_PIVOT) {
+                replay_structural(record.op, row, col, record.text, record.text_length);
+                applied++;
+            }
+        }
+        if (record.sequence > *last_sequence)
+            *last_sequence = record.sequence;
+        offset += RECORD_HEADER_SIZE + record.text_length;
+    }
+    *valid_length = offset;
+    return applied;
+}
+
+static char *concatenate(const char *first, const char *second) {
+    char *result = malloc(strlen(first) + strlen(second) + 1);
+    if (result != NULL) {
+        strcpy(result, first);
+        strcat(result, second);
+    }
+    return result;
+}
+
+// Registers the sheets listed in the directory at the end of the snapshot
+// without loading them, then loads the sheet that was active. Returns false if
+// the snapshot has no directory, as snapshots of a single sheet did not.
+static bool open_sheets(uint64_t *last_sequence) {
+    off_t size = lseek(snapshot_fd, 0, SEEK_END);
+    uint64_t directory_offset;
+    Buffer buffer = {NULL, 0, 0};
+    Record record;
+    if (size < 8 || !read_at(snapshot_fd, size - 8, &directory_offset, 8) ||
+        directory_offset >= (uint64_t) size - 8 ||
+        !read_snapshot_record((off_t) directory_offset, size - 8, &buffer, &record) ||
+        record.op != JOURNAL_DIRECTORY) {
+        free(buffer.data);
+        return false;
+    }
+    char *directory = record_text(&record);
+    char *active_name = NULL;
+    if (directory != NULL && read_snapshot_record(0, (off_t) directory_offset, &buffer, &record) &&
+        record.op == JOURNAL_CHECKPOINT) {
+        active_name = record_text(&record);
+        *last_sequence = record.sequence;
+    }
+    free(buffer.data);
+    if (active_name == NULL) {
+        free(directory);
+        return false;
+    }
+
+    // Register every sheet before loading any, so that references between sheets resolve.
+    const char *line = directory;
+    long long offset;
+    unsigned long length;
+    char name[SHEET_NAME_LENGTH];
+    int consumed;
+    while (sscanf(line, "%lld %lu %31s%n", &offset, &length, name, &consumed) == 3) {
+        int sheet = add_unloaded_sheet(name);
+        if (sheet >= 0) {
+            sections[sheet].offset = (off_t) offset;
+            sections[sheet].length = length;
+        }
+        line += consumed;
+    }
+    for (int sheet = 0; sheet < sheet_count(); sheet++) {
+        if (is_sheet_loaded(sheet) && sections[sheet].length > 0)
+            journal_load_sheet(sheet); // The active sheet is never unloaded, so it is filled now
+    }
+    activate_sheet(find_sheet(active_name));
+    free(active_name);
+    free(directory);
+    return true;
+}
+
+long journal_open(const char *path, unsigned commit_interval, unsigned long checkpoint_every) {
+    if (journal_fd >= 0)
+        journal_close();
+    if (snapshot_fd >= 0)
+        close(snapshot_fd);
+    memset(sections, 0, sizeof(sections));
+    journal_path = strdup(path);
+    snapshot_path = concatenate(path, ".snapshot");
+    if (journal_path == NULL || snapshot_path == NULL)
+        return -1;
+    commit_interval_ms = commit_interval;
+    checkpoint_records = checkpoint_every;
+
+    Buffer contents;
+    uint64_t last_sequence = 0;
+    size_t valid_length;
+    replaying = true;
+
+    // Open the last snapshot, if there is one. Its sheets are loaded when they are first used.
+    snapshot_fd = open(snapshot_path, O_RDONLY);
+    if (snapshot_fd >= 0 && !open_sheets(&last_sequence)) {
+        lseek(snapshot_fd, 0, SEEK_SET);
+        bool loaded = read_file(snapshot_fd, &contents);
+        if (!loaded) {
+            free(contents.data);
+            replaying = false;
+            return -1;
+        }
+        replay(&contents, 0, &last_sequence, &valid_length);
+        free(contents.data);
+    }
+
+    // Replay the edits made since the snapshot and cut off any torn tail.
+    journal_fd = open(journal_path, O_RDWR | O_CREAT, 0644);
+    if (journal_fd < 0 || !read_file(journal_fd, &contents)) {
+        if (journal_fd >= 0)
+            free(contents.data);
+        replaying = false;
+        return -1;
+    }
+    long replayed = replay(&contents, last_sequence, &last_sequence, &valid_length);
+    bool torn = valid_length < contents.length;
+    free(contents.data);
+    replaying = false;
+    if (torn && (ftruncate(journal_fd, (off_t) valid_length) < 0 || fsync(journal_fd) < 0))
+        return -1;
+    lseek(journal_fd, 0, SEEK_END);
+    sync_directory(journal_path);
+
+    next_sequence = last_sequence + 1;
+    records_since_checkpoint = (unsigned long) replayed;
+    pending.length = 0;
+    timespec_get(&last_commit, TIME_UTC);
+    return replayed;
+}
+
+static void log_record(uint8_t op, ROW row, COL col, const char *text) {
+    if (journal_fd < 0 || replaying)
+        return;
+
+    // Checkpoint before logging, while the sheet matches every logged edit.
+    if (checkpoint_records > 0 && records_since_checkpoint >= checkpoint_records)
+        journal_checkpoint();
+
+    if (!append_record(&pending, next_sequence++, op, row, col, text)) {
+        fprintf(stderr, "Memory allocation failed for journal record\n");
+        exit(1);
+    }
+    records_since_checkpoint++;
+
+    // Group commit: sync at most once per interval; later edits ride along.
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    long elapsed_ms = (long) (now.tv_sec - last_commit.tv_sec) * 1000 + (now.tv_nsec - last_commit.tv_nsec) / 1000000;
+    if (elapsed_ms >= (long) commit_interval_ms)
+        journal_flush();
+}
+
+void journal_log_set(ROW row, COL col, const char *text) {
+    log_record(JOURNAL_SET, row, col, text);
+}
+
+void journal_log_clear(ROW row, COL col) {
+    log_record(JOURNAL_CLEAR, row, col, NULL);
+}
+
+void journal_log_insert_row(ROW row) {
+    log_record(JOURNAL_INSERT_ROW, row, 0, NULL);
+}
+
+void journal_log_delete_row(ROW row) {
+    log_record(JOURNAL_DELETE_ROW, row, 0, NULL);
+}
+
+void journal_log_insert_col(COL col) {
+    log_record(JOURNAL_INSERT_COL, 0, col, NULL);
+}
+
+void journal_log_delete_col(COL col) {
+    log_record(JOURNAL_DELETE_COL, 0, col, NULL);
+}
+
+void journal_log_sort_rows(ROW first, ROW last, COL key, bool ascending) {
+    char arguments[32];
+    snprintf(arguments, sizeof(arguments), "%d %d", (int) last, ascending ? 1 : 0);
+    log_record(JOURNAL_SORT_ROWS, first, key, arguments);
+}
+
+void journal_log_add_sheet(const char *name) {
+    log_record(JOURNAL_ADD_SHEET, 0, 0, name);
+}
+
+void journal_log_activate_sheet(const char *name) {
+    log_record(JOURNAL_ACTIVATE_SHEET, 0, 0, name);
+}
+
+void journal_log_add_pivot(const PivotSpec *spec) {
+    char arguments[64];
+    format_pivot(spec, arguments, sizeof(arguments));
+    log_record(JOURNAL_ADD_PIVOT, 0, 0, arguments);
+}
+
+void journal_log_remove_pivot(ROW target_row, COL target_col) {
+    log_record(JOURNAL_REMOVE_PIVOT, target_row, target_col, NULL);
+}
+
+void journal_load_sheet(int sheet) {
+    if (snapshot_fd < 0 || sheet < 0 || sheet >= MAX_SHEETS || sections[sheet].length == 0)
+        return;
+    Buffer section = {malloc(sections[sheet].length), sections[sheet].length, sections[sheet].length};
+    if (section.data == NULL || !read_at(snapshot_fd, sections[sheet].offset, section.data, section.length)) {
+        diagnostic("Error: Failed to load sheet %s from the snapshot", sheet_name(sheet));
+        free(section.data);
+        return;
+    }
+    Record record;
+    for (size_t offset = 0; parse_record(section.data, section.length, offset, &record);
+         offset += RECORD_HEADER_SIZE + record.text_length) {
+        PivotSpec spec;
+        if (record.op == JOURNAL_ADD_PIVOT && parse_pivot(record.text, record.text_length, &spec))
+            load_sheet_pivot(sheet, &spec);
+        if (record.op != JOURNAL_SET)
+            continue;
+        char *text = record_text(&record);
+        if (text != NULL)
+            load_sheet_cell(sheet, (ROW) record.row, (COL) record.col, text);
+        free(text);
+    }
+    free(section.data);
+}
+
+// Returns true if a formula mentions a sheet by name, as in "=Data!A1". A name
+// that merely ends with it, as in "=OldData!A1", does not count.
+static bool mentions_sheet(const unsigned char *text, uint32_t text_length, const char *name) {
+    size_t name_length = strlen(name);
+    for (size_t i = 0; i + name_length < text_length; i++) {
+        if (i > 0 && (isalnum(text[i - 1]) || text[i - 1] == '_'))
+            continue;
+        if (memcmp(text + i, name, name_length) == 0 && text[i + name_length] == '!')
+            return true;
+    }
+    return false;
+}
+
+bool journal_sheet_refers_to(int sheet, const char *name) {
+    if (snapshot_fd < 0 || sheet < 0 || sheet >= MAX_SHEETS || sections[sheet].length == 0)
+        return false;
+    Buffer section = {malloc(sections[sheet].length), sections[sheet].length, sections[sheet].length};
+    if (section.data == NULL || !read_at(snapshot_fd, sections[sheet].offset, section.data, section.length)) {
+        free(section.data);
+        return true; // Loading the sheet reports the error
+    }
+    bool found = false;
+    Record record;
+    for (size_t offset = 0; !found && parse_record(section.data, section.length, offset, &record);
+         offset += RECORD_HEADER_SIZE + record.text_length) {
+        found = record.op == JOURNAL_SET && record.text_length > 0 && record.text[0] == '=' &&
+                mentions_sheet(record.text, record.text_length, name);
+    }
+    free(section.data);
+    return found;
+}
+
+bool journal_pending() {
+    return pending.length > 0;
+}
+
+bool journal_flush() {
+    if (journal_fd < 0)
+        return false;
+    timespec_get(&last_commit, TIME_UTC);
+    if (pending.length == 0)
+        return true;
+    off_t end = lseek(journal_fd, 0, SEEK_END);
+    if (end >= 0 && write_all(journal_fd, pending.data, pending.length) && fdatasync(journal_fd) == 0) {
+        pending.length = 0;
+        return true;
+    }
+    // Cut off any part of the records that reached the file, so that the next
+    // flush does not append after a torn record, which recovery would stop at.
+    // The edits stay pending and are written again by the next flush.
+    if (end >= 0 && (ftruncate(journal_fd, end) < 0 || lseek(journal_fd, end, SEEK_SET) < 0))
+        diagnostic("Error: Failed to truncate journal %s", journal_path);
+    diagnostic("Error: Failed to write journal %s", journal_path);
+    return false;
+}
+
+bool journal_checkpoint() {
+    if (journal_fd < 0 || !journal_flush())
+        return false;
+
+    // Every snapshot record carries the sequence number of the last edit it
+    // contains, so journal records up to that number are skipped on recovery.
+    // The checkpoint record names the active sheet; then comes a section of SET
+    // and ADD_PIVOT records per sheet, the directory of sections, and the offset of the
+    // directory, so that a sheet can be read without reading the others.
+    uint64_t sequence = next_sequence - 1;
+    Buffer snapshot = {NULL, 0, 0};
+    Buffer directory = {NULL, 0, 0};
+    Section written_sections[MAX_SHEETS];
+    bool built = append_record(&snapshot, sequence, JOURNAL_CHECKPOINT, 0, 0, sheet_name(active_sheet()));
+    for (int sheet = 0; sheet < sheet_count() && built; sheet++) {
+        size_t start = snapshot.length;
+        if (is_sheet_loaded(sheet)) {
+            for (int row = 0; row < NUM_ROWS && built; row++) {
+                for (int col = 0; col < NUM_COLS && built; col++) {
+                    if (is_pivot_output(sheet, row, col))
+                        continue;
+                    char *text = get_sheet_input_value(sheet, row, col);
+                    if (text != NULL)
+                        built = append_record(&snapshot, sequence, JOURNAL_SET, row, col, text);
+                    free(text);
+                }
+            }
+            // Pivots come after the cells, so that their output is computed from the loaded range
+            // and written to the cells left out above.
+            PivotSpec specs[MAX_PIVOTS];
+            int count = get_sheet_pivots(sheet, specs, MAX_PIVOTS);
+            for (int i = 0; i < count && built; i++) {
+                char arguments[64];
+                format_pivot(&specs[i], arguments, sizeof(arguments));
+                built = append_record(&snapshot, sequence, JOURNAL_ADD_PIVOT, 0, 0, arguments);
+            }
+        } else if (sections[sheet].length > 0) {
+            // A sheet that was never loaded is copied from the old snapshot as it is.
+            built = reserve(&snapshot, start + sections[sheet].length) &&
+                    read_at(snapshot_fd, sections[sheet].offset, snapshot.data + start, sections[sheet].length);
+            if (built)
+                snapshot.length += sections[sheet].length;
+        }
+        written_sections[sheet].offset = (off_t) start;
+        written_sections[sheet].length = snapshot.length - start;
+        char line[64 + SHEET_NAME_LENGTH];
+        int line_length = snprintf(line, sizeof(line), "%lld %lu %s\n", (long long) start,
+                                   (unsigned long) written_sections[sheet].length, sheet_name(sheet));
+        built = built && append_bytes(&directory, line, (size_t) line_length);
+    }
+    uint64_t directory_offset = snapshot.length;
+    built = built && append_bytes(&directory, "", 1) &&
+            append_record(&snapshot, sequence, JOURNAL_DIRECTORY, 0, 0, (const char *) directory.data) &&
+            append_bytes(&snapshot, &directory_offset, 8);
+    free(directory.data);
+
+    // Write the snapshot beside the old one and swap it in atomically.
+    char *temporary_path = concatenate(snapshot_path, ".tmp");
+    int fd = built && temporary_path != NULL ? open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    bool written = fd >= 0 && write_all(fd, snapshot.data, snapshot.length) && fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+    written = written && rename(temporary_path, snapshot_path) == 0;
+    free(snapshot.data);
+    free(temporary_path);
+    if (!written) {
+        diagnostic("Error: Failed to write snapshot %s", snapshot_path);
+        return false;
+    }
+    sync_directory(snapshot_path);
+
+    // Sheets that are not loaded yet are now read from the new snapshot.
+    if (snapshot_fd >= 0)
+        close(snapshot_fd);
+    snapshot_fd = open(snapshot_path, O_RDONLY);
+    if (snapshot_fd < 0)
+        diagnostic("Error: Failed to reopen snapshot %s", snapshot_path);
+    memcpy(sections, written_sections, sheet_count() * sizeof(Section));
+
+    // The snapshot now holds everything in the journal.
+    if (ftruncate(journal_fd, 0) < 0 || fsync(journal_fd) < 0)
+        return false;
+    lseek(journal_fd, 0, SEEK_SET);
+    records_since_checkpoint = 0;
+    return true;
+}
+
+void journal_close() {
+    if (journal_fd < 0)
+        return;
+    journal_flush();
+    close(journal_fd);
+    journal_fd = -1;
+    free(journal_path);
+    free(snapshot_path);
+    journal_path = NULL;
+    snapshot_path = NULL;
+    free(pending.data);
+    pending.data = NULL;
+    pending.length = 0;
+    pending.capacity = 0;
+}
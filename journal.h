@@ -0,0 +1,84 @@
+#ifndef ASSIGNMENT_JOURNAL_H
+#define ASSIGNMENT_JOURNAL_H
+
+#include <stdbool.h>
+
+#include "defs.h"
+#include "model.h"
+
+// Write-ahead journal of edits, so that a session survives a crash.
+//
+// Every 'set_cell_value', 'clear_cell' and structural edit (row and column
+// inserts, deletes and sorts) is appended to the journal before it is
+// applied, and so are adding and removing pivots. Adding and activating sheets
+// are journaled too; cell edits apply to the active sheet.
+//
+// Records are buffered and written out together ("group commit"): at most
+// once per commit interval, the buffer is written and synced to disk with a
+// single fdatasync. Periodically, the whole workbook is written to a snapshot
+// file next to the journal and the journal is truncated.
+//
+// On disk, every record is laid out in host byte order as
+//   crc (4) | sequence (8) | op (1) | row (2) | col (2) | length (4) | text
+// where the CRC-32 covers everything after the crc field. A torn or corrupt
+// record ends the journal. Structural edits store their row or column in the
+// row/col fields; a sort stores its last row and direction as text.
+//
+// A snapshot holds one section of records per sheet, followed by a directory
+// of the sections and, in its last 8 bytes, the offset of the directory.
+// Opening the journal only reads the directory; each sheet is read from its
+// section the first time it is used.
+
+// Opens the journal at 'path' (and its snapshot at '<path>.snapshot'), creating
+// them if needed, and replays them into the model. Must be called after
+// 'model_init' and before any edits.
+//
+// Edits are synced together once 'commit_interval_ms' milliseconds have
+// passed since the last sync; 0 syncs every edit. The interval is only
+// checked when an edit is logged, so after the last edit of a burst the
+// caller must call 'journal_flush' (see 'journal_pending') for it to reach
+// the disk. A checkpoint is taken after every 'checkpoint_records' edits; 0
+// only checkpoints on request.
+//
+// Returns the number of edits replayed from the journal, or -1 on error.
+long journal_open(const char *path, unsigned commit_interval_ms, unsigned long checkpoint_records);
+
+// Records an edit; called by the model before applying it. Does nothing if no
+// journal is open or the journal is being replayed.
+void journal_log_set(ROW row, COL col, const char *text);
+void journal_log_clear(ROW row, COL col);
+void journal_log_insert_row(ROW row);
+void journal_log_delete_row(ROW row);
+void journal_log_insert_col(COL col);
+void journal_log_delete_col(COL col);
+void journal_log_sort_rows(ROW first, ROW last, COL key, bool ascending);
+void journal_log_add_sheet(const char *name);
+void journal_log_activate_sheet(const char *name);
+void journal_log_add_pivot(const PivotSpec *spec);
+void journal_log_remove_pivot(ROW target_row, COL target_col);
+
+// Loads the cells of a sheet from the snapshot; called by the model the first
+// time a sheet registered with 'add_unloaded_sheet' is used. Sheets can still
+// be loaded after the journal is closed, until it is opened again.
+void journal_load_sheet(int sheet);
+
+// Returns true if a formula of a sheet that is still in the snapshot refers to
+// the sheet called 'name'. Reads the section of the sheet without loading it.
+bool journal_sheet_refers_to(int sheet, const char *name);
+
+// Returns true if edits are waiting to be synced to disk.
+bool journal_pending();
+
+// Writes and syncs all buffered edits now. On failure the edits stay buffered
+// and the journal is cut back to its last synced record, so a later flush can
+// retry them.
+bool journal_flush();
+
+// Writes the whole workbook to the snapshot file and truncates the journal.
+// Sheets that were never loaded are copied without being loaded.
+bool journal_checkpoint();
+
+// Flushes and closes the journal.
+void journal_close();
+
+#endif //ASSIGNMENT_JOURNAL_H
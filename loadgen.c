@@ -0,0 +1,197 @@
+#include "defs.h"
+#include "protocol.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Opens many connections to spreadsheetd and keeps a window of pipelined
+// requests outstanding on each, then reports the throughput.
+//
+// The request mix is 60% GET, 30% SET of a number and 10% RANGE over the whole
+// sheet. Before the run, the last column is filled with formulas summing the
+// rest of its row, so every SET also causes a recalculation.
+
+typedef struct {
+    int fd;
+    long sent;
+    long received;
+} Connection;
+
+static int connect_to(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t amount = write(fd, buffer, length);
+        if (amount < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += amount;
+        length -= amount;
+    }
+    return 0;
+}
+
+// Appends one random request to 'buffer' and returns its length.
+static int format_request(char *buffer, size_t size) {
+    int kind = rand() % 10;
+    char col = (char) ('A' + rand() % (NUM_COLS - 1));
+    int row = rand() % NUM_ROWS + 1;
+    if (kind < 6)
+        return snprintf(buffer, size, "GET %c%d\n", col, row);
+    if (kind < 9)
+        return snprintf(buffer, size, "SET %c%d %d\n", col, row, rand() % 1000);
+    return snprintf(buffer, size, "RANGE A1 %c%d\n", 'A' + NUM_COLS - 1, NUM_ROWS);
+}
+
+// Fills the last column with formulas so that edits trigger recalculation.
+static int set_up_formulas(int fd) {
+    char buffer[MAX_LINE_LENGTH];
+    int length = snprintf(buffer, sizeof(buffer), "BATCH %d\n", NUM_ROWS);
+    if (write_all(fd, buffer, length) < 0)
+        return -1;
+    for (int row = 1; row <= NUM_ROWS; row++) {
+        length = snprintf(buffer, sizeof(buffer), "%c%d =", 'A' + NUM_COLS - 1, row);
+        for (int col = 0; col < NUM_COLS - 1; col++)
+            length += snprintf(buffer + length, sizeof(buffer) - length, "%s%c%d", col > 0 ? "+" : "", 'A' + col,
+                               row);
+        length += snprintf(buffer + length, sizeof(buffer) - length, "\n");
+        if (write_all(fd, buffer, length) < 0)
+            return -1;
+    }
+    // Wait for "OK <n>".
+    char reply[64];
+    ssize_t amount = read(fd, reply, sizeof(reply));
+    return amount > 0 && strncmp(reply, "OK", 2) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    const char *path = DEFAULT_SOCKET_PATH;
+    int num_connections = 32;
+    long requests_per_connection = 10000;
+    int depth = 64;
+    int option;
+    while ((option = getopt(argc, argv, "s:c:n:d:")) != -1) {
+        switch (option) {
+            case 's':
+                path = optarg;
+                break;
+            case 'c':
+                num_connections = atoi(optarg);
+                break;
+            case 'n':
+                requests_per_connection = atol(optarg);
+                break;
+            case 'd':
+                depth = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s socket_path] [-c connections] [-n requests] [-d depth]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (num_connections < 1 || requests_per_connection < 1 || depth < 1) {
+        fprintf(stderr, "Connections, requests and depth must be positive\n");
+        return 2;
+    }
+
+    Connection *connections = calloc(num_connections, sizeof(Connection));
+    struct pollfd *fds = calloc(num_connections, sizeof(struct pollfd));
+    char *buffer = malloc((size_t) depth * 64 + MAX_LINE_LENGTH);
+    if (connections == NULL || fds == NULL || buffer == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    for (int i = 0; i < num_connections; i++) {
+        connections[i].fd = connect_to(path);
+        if (connections[i].fd < 0) {
+            fprintf(stderr, "Could not connect to %s\n", path);
+            return 1;
+        }
+        fds[i].fd = connections[i].fd;
+        fds[i].events = POLLIN;
+    }
+    if (set_up_formulas(connections[0].fd) < 0) {
+        fprintf(stderr, "Setting up formulas failed\n");
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int active = num_connections;
+    while (active > 0) {
+        // Top up every connection's window of outstanding requests.
+        for (int i = 0; i < num_connections; i++) {
+            Connection *connection = &connections[i];
+            size_t length = 0;
+            while (connection->sent < requests_per_connection && connection->sent - connection->received < depth) {
+                length += format_request(buffer + length, 64);
+                connection->sent++;
+            }
+            if (length > 0 && write_all(connection->fd, buffer, length) < 0) {
+                perror("write");
+                return 1;
+            }
+        }
+
+        if (poll(fds, num_connections, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            return 1;
+        }
+
+        // Every request is answered by exactly one line.
+        for (int i = 0; i < num_connections; i++) {
+            if (!fds[i].revents)
+                continue;
+            ssize_t amount = read(fds[i].fd, buffer, MAX_LINE_LENGTH);
+            if (amount <= 0) {
+                fprintf(stderr, "Server closed connection %d\n", i);
+                return 1;
+            }
+            for (ssize_t j = 0; j < amount; j++)
+                if (buffer[j] == '\n')
+                    connections[i].received++;
+            if (connections[i].received >= requests_per_connection) {
+                fds[i].fd = -1;
+                active--;
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+    long total = requests_per_connection * num_connections;
+    printf("%ld requests over %d connections (depth %d) in %.3f s: %.0f requests/s\n", total, num_connections, depth,
+           seconds, (double) total / seconds);
+
+    for (int i = 0; i < num_connections; i++)
+        close(connections[i].fd);
+    free(connections);
+    free(fds);
+    free(buffer);
+    return 0;
+}
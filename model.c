@@ -4,23 +4,31 @@
 // Queen's University, Smith Engineering ECE
 
 #include "model.h"
+#include "diagnostics.h"
 #include "interface.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "spill.h"
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <ctype.h>
 #include <stdbool.h>
 
 // Defines a struct called Node, which represents a node in a linked list.
 // Each node can have a type of either REFERENCE or CONSTANT.
-// If the type is REFERENCE, the content of the node is a cell reference, consisting of a row and column index.
+// If the type is REFERENCE, the content of the node is a cell reference, consisting of a sheet and a row and column index.
 // If the type is CONSTANT, the content of the node is a constant value.
 // The struct also contains a pointer to the next node in the list.
 typedef struct Node {
     enum { REFERENCE, CONSTANT } type;
     union {
         struct {
+            struct Sheet *sheet; // Sheet of the referenced cell (NULL if the sheet does not exist)
             int row;
             int col;
         } reference; // Cell reference
@@ -29,13 +37,35 @@ typedef struct Node {
     struct Node *next; // Pointer to the next node in the list
 } Node;
 
+// Defines a struct called Value, which is the result of evaluating a formula.
+// If the error is not ERROR_NONE, the formula failed and the number is meaningless.
+// Errors are carried along with the number, so evaluation never has to print anything.
+typedef struct Value {
+    double number;
+    CELL_ERROR error;
+} Value;
+
+// Defines a struct called Compiled, which is a formula reduced to the shape it has after constant folding.
+// Most formulas are a constant, a copy of one cell (=A1), one cell plus a constant (=A1+0.2)
+// or two cells plus a constant (=A1+B1); those are evaluated without walking the linked list.
+// A formula whose first reference is invalid is INVALID_REFERENCE, since evaluation stops at the first error.
+// Anything else is GENERIC and evaluated by walking the list with the folded constant.
+typedef struct Compiled {
+    enum { GENERIC, CONSTANT_ONLY, ALIAS, REFERENCE_PLUS_CONSTANT, TWO_REFERENCES, INVALID_REFERENCE } shape;
+    double constant; // Sum of every constant in the formula
+    struct Cell *first; // Referenced cells, for the ALIAS, REFERENCE_PLUS_CONSTANT and TWO_REFERENCES shapes
+    struct Cell *second;
+} Compiled;
+
 // This code defines a struct called Cell, which represents a cell in a spreadsheet.
 // Each cell can have a type of TEXT, NUMBER, FORMULA, or BLANK.
 // If the type is TEXT, the content of the cell is a string.
 // If the type is NUMBER, the content of the cell is a numeric value.
 // If the type is FORMULA, the content of the cell is a linked list of nodes representing a parsed formula.
 // If the type is BLANK, the cell is empty.
-// The struct also contains additional fields such as the original formula string, an array of pointers to cells that depend on this cell, and the number of dependents.
+// The struct also contains additional fields such as the original formula string, the last computed value of a formula,
+// an array of pointers to cells that depend on this cell, and the number of dependents.
+// Dependents can be on any sheet of the workbook.
 typedef struct Cell {
     enum { TEXT, NUMBER, FORMULA, BLANK } type;
     union {
@@ -44,23 +74,458 @@ typedef struct Cell {
         Node* formula;   // For parsed formula
     } content;
     char* original_formula; // Additional field to store the original formula string
+    Value value; // Last computed value of a formula (kept apart from the union so the parsed formula survives recalculation)
+    Compiled compiled; // Specialized form of the formula
     struct Cell **dependents; // Array of pointers to cells that depend on this cell
     int num_dependents;
+    struct Sheet *sheet; // Sheet the cell belongs to
 } Cell;
 
-// Initialize a spreadsheet using the structs above
-Cell spreadsheet[NUM_ROWS][NUM_COLS];
+// Defines a struct called Sheet, which is one sheet of the workbook.
+// Cells never move inside the cells array; its indices are the "physical" row and column of a cell.
+// The maps translate between the logical row/column a cell is shown at and its physical row/column.
+// Inserting, deleting and sorting only permute these maps, so formula references,
+// which store physical indices, stay valid without being rewritten
+typedef struct Sheet {
+    int index; // Position of the sheet in the workbook
+    Cell cells[NUM_ROWS][NUM_COLS];
+    int row_map[NUM_ROWS]; // Logical row -> physical row
+    int col_map[NUM_COLS]; // Logical column -> physical column
+    int row_position[NUM_ROWS]; // Physical row -> logical row
+    int col_position[NUM_COLS]; // Physical column -> logical column
+    size_t payload_bytes; // Bytes held by the text and formulas of the cells (see cell_payload_bytes)
+    bool spilled; // The text and formulas are in the spill file instead of in memory
+    bool spill_valid; // The spill file holds the current text and formulas, so evicting them again needs no write
+    bool referenced; // Used since the CLOCK hand last passed
+    long spill_offset; // Block of the spill file holding the text and formulas, or -1
+    size_t spill_length;
+    size_t spill_capacity;
+} Sheet;
+
+// Number of cells in one sheet
+#define SHEET_CELLS (NUM_ROWS * NUM_COLS)
+
+// The workbook. Every sheet has a name, but a sheet is only allocated once it is first viewed or referenced;
+// until then its cells stay in the snapshot file of the journal
+char sheet_names[MAX_SHEETS][SHEET_NAME_LENGTH];
+Sheet *sheets[MAX_SHEETS]; // NULL while a sheet is not loaded
+int num_sheets = 0;
+Sheet *active = NULL; // The sheet that is displayed and edited through set_cell_value and friends
+
+// Longest chain of dependents followed by update_dependents
+#define MAX_RECALCULATION_DEPTH 256
+
+// Out-of-core mode: once the text and formulas held in memory exceed the budget, the sheets used least recently
+// (picked by the CLOCK algorithm) have theirs written to the spill file and freed, and they are read back the next
+// time they are needed. Cells, their values and their compiled formulas stay in memory, so recalculating a spilled
+// sheet only reads it back for formulas that need the generic evaluator. The active sheet is never spilled.
+size_t memory_budget = 0; // 0 means no limit
+size_t resident_bytes = 0; // Bytes of text and formulas in memory, over all sheets
+int clock_hand = 0;
+unsigned long resident_hits = 0; // Accesses to text and formulas that were in memory
+unsigned long resident_misses = 0; // Accesses that had to read a sheet back from the spill file
+unsigned long evictions = 0;
+
+// Marks a reference to a deleted row or column (the parser never produces a negative column)
+#define DELETED_REFERENCE (-1)
+
+// Whether formulas are evaluated through their compiled shape (turned off to benchmark the generic evaluator)
+bool specialization_enabled = true;
+
+// Logical cells of the active sheet whose changes are pushed to the interface (see set_display_window)
+int window_row = 0;
+int window_col = 0;
+int window_rows = NUM_ROWS;
+int window_cols = NUM_COLS;
+
+// Changes with every committed edit, so scenarios know when their overlay is stale
+unsigned long model_version = 1;
+
+// Formula cells of every loaded sheet in an order where every formula comes after the formulas it references
+// It is rebuilt by recalculate_all whenever a formula has been added, removed or changed
+Cell *recalculation_order[MAX_SHEETS * SHEET_CELLS];
+int recalculation_order_index[MAX_SHEETS * SHEET_CELLS]; // cell_index of each cell in the order
+int recalculation_order_length = 0;
+bool recalculation_order_valid = false;
+bool in_cycle[MAX_SHEETS * SHEET_CELLS]; // Formulas found to close a circular reference while building the order
+
+// Get the cell shown at a logical row and column of the active sheet
+Cell *cell_at(int row, int col) {
+    return &active->cells[active->row_map[row]][active->col_map[col]];
+}
+
+// Number a cell uniquely within the workbook: sheet index * SHEET_CELLS + physical row * NUM_COLS + physical column
+int cell_index(Cell *cell) {
+    return cell->sheet->index * SHEET_CELLS + (int) (cell - &cell->sheet->cells[0][0]);
+}
+
+// Find the physical row and column of a cell from its address in the cells array of its sheet
+void physical_position(Cell *cell, int *row, int *col) {
+    int index = (int) (cell - &cell->sheet->cells[0][0]);
+    *row = index / NUM_COLS;
+    *col = index % NUM_COLS;
+}
+
+// Get the cell a reference node points to, or NULL if the reference is invalid or deleted
+Cell *referenced_cell(Node *node) {
+    int row = node->content.reference.row;
+    int col = node->content.reference.col;
+    if (node->content.reference.sheet == NULL || row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
+        return NULL;
+    }
+    return &node->content.reference.sheet->cells[row][col];
+}
+
+// Allocate a blank sheet for position 'index' of the workbook, with every cell shown at its physical position
+Sheet *new_sheet(int index) {
+    Sheet *sheet = malloc(sizeof(Sheet));
+    if (sheet == NULL) {
+        fprintf(stderr, "Memory allocation failed for sheet\n");
+        exit(1);
+    }
+    sheet->index = index;
+    sheet->payload_bytes = 0;
+    sheet->spilled = false;
+    sheet->spill_valid = false;
+    sheet->referenced = true;
+    sheet->spill_offset = -1;
+    sheet->spill_length = 0;
+    sheet->spill_capacity = 0;
+    for (int i = 0; i < NUM_ROWS; i++) {
+        for (int j = 0; j < NUM_COLS; j++) {
+            Cell *cell = &sheet->cells[i][j];
+            cell->type = BLANK; // Set cell type to BLANK
+            cell->content.text = NULL; // Set content text to NULL
+            cell->original_formula = NULL; // Set original formula to NULL
+            cell->value = (Value) {0.0, ERROR_NONE}; // Set formula value to 0
+            cell->dependents = NULL; // Set dependents to NULL
+            cell->num_dependents = 0; // Set number of dependents to 0
+            cell->sheet = sheet;
+        }
+        sheet->row_map[i] = i;
+        sheet->row_position[i] = i;
+    }
+    for (int j = 0; j < NUM_COLS; j++) {
+        sheet->col_map[j] = j;
+        sheet->col_position[j] = j;
+    }
+    return sheet;
+}
+
+// Helper function to free memory for a formula linked list
+// It takes in a pointer to the head of the linked list as a parameter
+void free_formula(Node *formula) {
+    while (formula != NULL) {
+        Node *temp = formula;
+        formula = formula->next;
+        free(temp);
+    }
+}
+
+// Remove the formula of a cell: take the cell off the dependents of every cell it references, then free it
+// Without this, changing a referenced cell would still recalculate the cell, and could report a circular
+// reference that no longer exists
+void drop_formula(Cell *cell) {
+    for (Node *node = cell->content.formula; node != NULL; node = node->next) {
+        Cell *referenced = node->type == REFERENCE ? referenced_cell(node) : NULL;
+        if (referenced == NULL) {
+            continue; // Deleted references were already taken off (see invalidate_references)
+        }
+        // A formula is listed once per reference to a cell, so remove one entry, keeping the order of the others
+        for (int i = 0; i < referenced->num_dependents; i++) {
+            if (referenced->dependents[i] == cell) {
+                memmove(&referenced->dependents[i], &referenced->dependents[i + 1],
+                        (referenced->num_dependents - i - 1) * sizeof(Cell *));
+                referenced->num_dependents--;
+                break;
+            }
+        }
+    }
+    free_formula(cell->content.formula);
+    free(cell->original_formula);
+    cell->content.formula = NULL;
+    cell->original_formula = NULL;
+    recalculation_order_valid = false;
+}
+
+// Count the bytes a cell holds outside of its struct: its text, or its formula string and nodes
+size_t cell_payload_bytes(Cell *cell) {
+    size_t bytes = 0;
+    if (cell->type == TEXT && cell->content.text != NULL) {
+        bytes = strlen(cell->content.text) + 1;
+    } else if (cell->type == FORMULA) {
+        if (cell->original_formula != NULL) {
+            bytes = strlen(cell->original_formula) + 1;
+        }
+        for (Node *node = cell->content.formula; node != NULL; node = node->next) {
+            bytes += sizeof(Node);
+        }
+    }
+    return bytes;
+}
+
+// Record that the text or formula of a cell of a sheet changed from 'before' to 'after' bytes
+void account_payload(Sheet *sheet, size_t before, size_t after) {
+    sheet->payload_bytes += after - before; // Wraps around correctly when shrinking
+    resident_bytes += after - before;
+    sheet->spill_valid = false;
+}
+
+// Layout of a spilled sheet: for each cell with text or a formula, its physical index (2 bytes), its type (1),
+// the length of its text or formula string (4), its number of nodes (4) and the string, then each node as its
+// type (1) and either its constant or the sheet index, row and column of its reference (12)
+#define SPILLED_CELL_HEADER (2 + 1 + 4 + 4)
+#define SPILLED_NODE_SIZE (1 + 12)
+
+// Write the text and formulas of a sheet to the spill file and free them
+// Returns false, leaving them in memory, if they could not be written
+bool evict_sheet(Sheet *sheet) {
+    Cell *cells = &sheet->cells[0][0];
+    if (!sheet->spill_valid) {
+        size_t length = 0;
+        for (int i = 0; i < SHEET_CELLS; i++) {
+            if (cells[i].type == TEXT && cells[i].content.text != NULL) {
+                length += SPILLED_CELL_HEADER + strlen(cells[i].content.text);
+            } else if (cells[i].type == FORMULA && cells[i].original_formula != NULL) {
+                length += SPILLED_CELL_HEADER + strlen(cells[i].original_formula);
+                for (Node *node = cells[i].content.formula; node != NULL; node = node->next) {
+                    length += SPILLED_NODE_SIZE;
+                }
+            }
+        }
+        unsigned char *block = malloc(length > 0 ? length : 1);
+        if (block == NULL) {
+            return false;
+        }
+        unsigned char *position = block;
+        for (int i = 0; i < SHEET_CELLS; i++) {
+            const char *text;
+            if (cells[i].type == TEXT && cells[i].content.text != NULL) {
+                text = cells[i].content.text;
+            } else if (cells[i].type == FORMULA && cells[i].original_formula != NULL) {
+                text = cells[i].original_formula;
+            } else {
+                continue;
+            }
+            uint16_t index = (uint16_t) i;
+            uint32_t text_length = (uint32_t) strlen(text);
+            uint32_t num_nodes = 0;
+            Node *formula = cells[i].type == FORMULA ? cells[i].content.formula : NULL;
+            for (Node *node = formula; node != NULL; node = node->next) {
+                num_nodes++;
+            }
+            memcpy(position, &index, 2);
+            position[2] = (unsigned char) cells[i].type;
+            memcpy(position + 3, &text_length, 4);
+            memcpy(position + 7, &num_nodes, 4);
+            memcpy(position + SPILLED_CELL_HEADER, text, text_length);
+            position += SPILLED_CELL_HEADER + text_length;
+            for (Node *node = formula; node != NULL; node = node->next) {
+                position[0] = (unsigned char) node->type;
+                if (node->type == CONSTANT) {
+                    memcpy(position + 1, &node->content.constant, sizeof(double));
+                } else {
+                    int32_t reference[3] = {
+                        node->content.reference.sheet != NULL ? node->content.reference.sheet->index : -1,
+                        node->content.reference.row,
+                        node->content.reference.col,
+                    };
+                    memcpy(position + 1, reference, sizeof(reference));
+                }
+                position += SPILLED_NODE_SIZE;
+            }
+        }
+        bool written = spill_write(block, length, &sheet->spill_offset, &sheet->spill_capacity);
+        free(block);
+        if (!written) {
+            return false;
+        }
+        sheet->spill_length = length;
+        sheet->spill_valid = true;
+    }
+
+    for (int i = 0; i < SHEET_CELLS; i++) {
+        if (cells[i].type == TEXT) {
+            free(cells[i].content.text);
+            cells[i].content.text = NULL;
+        } else if (cells[i].type == FORMULA) {
+            free_formula(cells[i].content.formula);
+            free(cells[i].original_formula);
+            cells[i].content.formula = NULL;
+            cells[i].original_formula = NULL;
+        }
+    }
+    resident_bytes -= sheet->payload_bytes;
+    sheet->spilled = true;
+    evictions++;
+    return true;
+}
+
+// Read the text and formulas of a spilled sheet back from the spill file
+void fault_in_sheet(Sheet *sheet) {
+    unsigned char *block = malloc(sheet->spill_length > 0 ? sheet->spill_length : 1);
+    if (block == NULL || !spill_read(sheet->spill_offset, block, sheet->spill_length)) {
+        fprintf(stderr, "Failed to read sheet %s back from the spill file\n", sheet_names[sheet->index]);
+        exit(1);
+    }
+    Cell *cells = &sheet->cells[0][0];
+    const unsigned char *position = block;
+    while (position < block + sheet->spill_length) {
+        uint16_t index;
+        uint32_t text_length, num_nodes;
+        memcpy(&index, position, 2);
+        memcpy(&text_length, position + 3, 4);
+        memcpy(&num_nodes, position + 7, 4);
+        char *text = malloc(text_length + 1);
+        if (text == NULL) {
+            fprintf(stderr, "Memory allocation failed for cell text\n");
+            exit(1);
+        }
+        memcpy(text, position + SPILLED_CELL_HEADER, text_length);
+        text[text_length] = '\0';
+        position += SPILLED_CELL_HEADER + text_length;
+
+        Cell *cell = &cells[index];
+        if (cell->type == TEXT) {
+            cell->content.text = text;
+            continue;
+        }
+        cell->original_formula = text;
+        Node **current = &cell->content.formula;
+        for (uint32_t k = 0; k < num_nodes; k++) {
+            *current = malloc(sizeof(Node));
+            if (*current == NULL) {
+                fprintf(stderr, "Memory allocation failed for node\n");
+                exit(1);
+            }
+            (*current)->type = position[0] == CONSTANT ? CONSTANT : REFERENCE;
+            if ((*current)->type == CONSTANT) {
+                memcpy(&(*current)->content.constant, position + 1, sizeof(double));
+            } else {
+                int32_t reference[3];
+                memcpy(reference, position + 1, sizeof(reference));
+                (*current)->content.reference.sheet = reference[0] >= 0 ? sheets[reference[0]] : NULL;
+                (*current)->content.reference.row = reference[1];
+                (*current)->content.reference.col = reference[2];
+            }
+            (*current)->next = NULL;
+            current = &(*current)->next;
+            position += SPILLED_NODE_SIZE;
+        }
+    }
+    free(block);
+    resident_bytes += sheet->payload_bytes;
+    sheet->spilled = false;
+}
+
+// Make sure the text and formulas of a sheet are in memory, reading them back from the spill file if needed
+// Must be called before reading or changing the text, original formula or nodes of a cell
+void make_resident(Sheet *sheet) {
+    if (sheet->spilled) {
+        resident_misses++;
+        fault_in_sheet(sheet);
+    } else {
+        resident_hits++;
+    }
+    sheet->referenced = true;
+}
+
+// Spill sheets until the text and formulas in memory fit the budget
+// Only called once an operation has finished, since it frees nodes and text that the operation might be using
+void enforce_memory_budget() {
+    if (memory_budget == 0 || num_sheets == 0) {
+        return;
+    }
+    // Two full turns of the clock: the first may only clear the referenced bits
+    for (int scanned = 0; resident_bytes > memory_budget && scanned < 2 * num_sheets; scanned++) {
+        Sheet *sheet = sheets[clock_hand];
+        clock_hand = (clock_hand + 1) % num_sheets;
+        if (sheet == NULL || sheet == active || sheet->spilled || sheet->payload_bytes == 0) {
+            continue;
+        }
+        if (sheet->referenced) {
+            sheet->referenced = false; // Second chance
+            continue;
+        }
+        evict_sheet(sheet);
+    }
+}
+
+// Get a sheet of the workbook, loading it from the snapshot of the journal the first time it is used
+Sheet *use_sheet(int index) {
+    if (sheets[index] == NULL) {
+        // Store the sheet before loading it, so formulas on other sheets that refer back to it find it
+        sheets[index] = new_sheet(index);
+        journal_load_sheet(index);
+    }
+    return sheets[index];
+}
+
+// Load the sheets still in the snapshot that refer to the active sheet, before its rows or columns move
+// A sheet in the snapshot refers to other sheets by the row and column they were shown at when the snapshot was
+// written, and a checkpoint copies it as it is, so those rows and columns must not move while it is unloaded
+// Once loaded, its references point at cells, which follow the moves like every other reference
+void load_referring_sheets() {
+    for (int i = 0; i < num_sheets; i++) {
+        if (sheets[i] == NULL && journal_sheet_refers_to(i, sheet_names[active->index])) {
+            use_sheet(i);
+        }
+    }
+}
+
+// Publishes the current cell values of every loaded sheet that changed as new snapshots for concurrent readers
+// This is called once an edit and all of its recalculation have finished
+static void commit_snapshot() {
+    for (int k = 0; k < num_sheets; k++) {
+        Sheet *sheet = sheets[k];
+        if (sheet == NULL || sheet->spilled) {
+            continue; // Its values cannot have changed since it was last published
+        }
+        // Formulas on any loaded sheet may refer to the edited one, so each is copied and published if it changed
+        Snapshot *snapshot = snapshot_begin(k);
+        for (int i = 0; i < NUM_ROWS; i++) {
+            for (int j = 0; j < NUM_COLS; j++) {
+                Cell *cell = &sheet->cells[sheet->row_map[i]][sheet->col_map[j]]; // Readers see the sheet in logical order
+                snapshot->errors[i][j] = ERROR_NONE;
+                if (cell->type == NUMBER) {
+                    snapshot->values[i][j] = cell->content.number;
+                    snapshot->has_value[i][j] = true;
+                } else if (cell->type == FORMULA) {
+                    snapshot->values[i][j] = cell->value.number;
+                    snapshot->errors[i][j] = cell->value.error;
+                    snapshot->has_value[i][j] = cell->value.error == ERROR_NONE;
+                } else {
+                    snapshot->values[i][j] = 0.0;
+                    snapshot->has_value[i][j] = false; // Text and blank cells have no numeric value
+                }
+            }
+        }
+        snapshot_commit(snapshot);
+    }
+    model_version++; // Scenarios evaluated before this edit are stale
+}
 
 // Convert a column letter to a column index (used for formula parsing)
 int col_letter_to_index(char col_letter) {
     return toupper(col_letter) - 'A'; 
 }
 
+// Find a sheet by the first 'length' characters of 'name'
+int find_sheet_name(const char *name, size_t length) {
+    for (int i = 0; i < num_sheets; i++) {
+        if (strlen(sheet_names[i]) == length && strncmp(sheet_names[i], name, length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 // Parse a formula string and return a linked list of nodes
 // Each node is a structure with a type and a union
 // The type can be CELL_REF or CONSTANT
 // The union contains the content of the node, which is either a cell reference or a constant
-Node *parse_formula(const char *formula_string, ROW current_row, COL current_col) {
+// References are to the sheet of the current cell unless they start with a sheet name and '!' (Sheet2!A1)
+Node *parse_formula(const char *formula_string, Cell *current_cell) {
     Node *head = NULL; // Initialize a pointer to the head of the linked list
     Node **current = &head; // Initialize a pointer to the current node
 
@@ -72,35 +537,61 @@ Node *parse_formula(const char *formula_string, ROW current_row, COL current_col
             ptr++; 
             // Using isalpha to check for alphabetic characters
         } else if (isalpha(*ptr)) {
+            Sheet *sheet = current_cell->sheet;
+            // A name followed by '!' is the sheet of the reference
+            const char *name_end = ptr;
+            while (isalnum(*name_end) || *name_end == '_') name_end++;
+            if (*name_end == '!') {
+                int index = find_sheet_name(ptr, name_end - ptr);
+                sheet = index >= 0 ? use_sheet(index) : NULL; // Referring to a sheet loads it
+                ptr = name_end + 1;
+            }
+
             // Convert the letter to a column index
-            int col = col_letter_to_index(*ptr);
-            ptr++; // Move to the next character
+            int col = -1;
+            if (isalpha(*ptr)) {
+                col = col_letter_to_index(*ptr);
+                ptr++; // Move to the next character
+            }
 
             int row = atoi(ptr) - 1; // Convert the number after the letter to a row index using atoi
             while (isdigit(*ptr)) ptr++; // Move to the next character until a non-digit character is encountered
 
+            // References are stored by physical row and column so they survive structural edits
+            bool valid = sheet != NULL && row >= 0 && row < NUM_ROWS && col >= 0 && col < NUM_COLS;
+            if (valid) {
+                row = sheet->row_map[row];
+                col = sheet->col_map[col];
+            }
+
             *current = malloc(sizeof(Node)); // Allocate memory for a new node
             // Checking if memory allocation failed
             if (*current == NULL) {
-                fprintf(stderr, "Error: Failed to allocate memory for node\n"); 
+                diagnostic("Error: Failed to allocate memory for node");
                 return NULL; 
             }
 
             (*current)->type = REFERENCE; // Set the node type to REFERENCE
+            (*current)->content.reference.sheet = sheet; // Set the sheet of the reference
             (*current)->content.reference.row = row; // Set the row index of the reference
             (*current)->content.reference.col = col; // Set the column index of the reference
             (*current)->next = NULL; // Set the next pointer of the node to NULL
             current = &((*current)->next); // Move the current pointer to the next node
 
-            Cell *referenced_cell = &spreadsheet[row][col]; // Get a pointer to the referenced cell in the spreadsheet
+            // Out of range references are reported when the formula is evaluated
+            if (!valid) {
+                continue;
+            }
+
+            Cell *referenced_cell = &sheet->cells[row][col]; // Get a pointer to the referenced cell in its sheet
             referenced_cell->dependents = realloc(referenced_cell->dependents, (referenced_cell->num_dependents + 1) * sizeof(Cell *)); // Reallocate memory for the dependents array of the referenced cell
             // Check if memory reallocation failed
             if (referenced_cell->dependents == NULL) {
-                fprintf(stderr, "Error: Failed to reallocate memory for dependents array\n"); 
+                diagnostic("Error: Failed to reallocate memory for dependents array");
                 return NULL; 
             }
 
-            referenced_cell->dependents[referenced_cell->num_dependents] = &spreadsheet[current_row][current_col]; // Add the current cell as a dependent of the referenced cell
+            referenced_cell->dependents[referenced_cell->num_dependents] = current_cell; // Add the current cell as a dependent of the referenced cell
             referenced_cell->num_dependents++; // Increment the number of dependents for the referenced cell
         } 
         // Check if the character is a digit or a decimal point
@@ -108,7 +599,7 @@ Node *parse_formula(const char *formula_string, ROW current_row, COL current_col
             double constant = strtod(ptr, (char **)&ptr); // Convert the substring starting from the current character to a double constant
             *current = malloc(sizeof(Node)); // Allocate memory for a new node
             if (*current == NULL) { 
-                fprintf(stderr, "Error: Failed to allocate memory for node\n"); 
+                diagnostic("Error: Failed to allocate memory for node");
                 return NULL; 
             }
 
@@ -124,102 +615,300 @@ Node *parse_formula(const char *formula_string, ROW current_row, COL current_col
     return head; // Return the head of the linked list. Yay!
 }
 
-// Checks if a given cell is involved in a circular dependency in a spreadsheet.
-// If it finds that the cell in question is already in the recalculation array,
-// it means that while recalculating the value of this cell, we have encountered this cell again, 
-// indicating a circular dependency. In this case, it returns true.
-// If it iterates over the entire recalculation array without finding the cell, 
-// it means there is no circular dependency involving this cell, and it returns false.
-// FUNCTION NOT USED IN THE FINAL VERSION OF THE PROGRAM since it does not work!
-// I think 
-bool is_circular_dependency(Cell *cell, Cell **recalculation_stack, int stack_size) {
-    // Check if the current cell is already in the recalculation stack
-    for (int i = 0; i < stack_size; i++) {
-        if (recalculation_stack[i] == cell) {
-            return true; // Circular dependency detected
-        }
-    }
-    // If the cell is of type FORMULA, recursively check for circular dependency in its references
-    // Recursive was good for this because it can be n amounts of references, technically
-    if (cell->type == FORMULA && cell->content.formula != NULL) {
-        // Creating a pointer to the formula with the formula linked list node
-        Node *current = cell->content.formula;
-        while (current != NULL) {
-            if (current->type == REFERENCE) {
-                Cell *referenced_cell = &spreadsheet[current->content.reference.row][current->content.reference.col];
-                if (is_circular_dependency(referenced_cell, recalculation_stack, stack_size + 1)) {
-                    return true;
-                }
-            }
-            current = current->next;
-        }
-    }
-
-    return false;
-}
-
-
 // Evaluates a formula represented by a linked list of nodes.
 // The formula can contain cell references and constants.
 // If a cell reference is encountered, it retrieves the value from the corresponding cell in the spreadsheet.
 // If a constant is encountered, it adds the constant value to the result.
-// If an invalid cell reference is encountered, it prints an error message and returns 0.0.
-// If a non-numeric cell is encountered, it prints a warning message and treats the cell as 0 in the formula.
-double evaluate_formula(Node *formula) {
-    double result = 0.0; // Initialize the result to 0.0
+// Blank cells count as 0. Instead of printing anything, problems are returned as an error in the result:
+// an invalid or deleted reference gives ERROR_REF, a text cell gives ERROR_VALUE,
+// and a referenced formula with an error passes its error on.
+Value evaluate_formula(Node *formula) {
+    Value result = {0.0, ERROR_NONE}; // Initialize the result to 0.0
     while (formula != NULL) { // Iterate through the formula linked list
         // If the node represents a cell reference
         if (formula->type == REFERENCE) {
-            if (formula->content.reference.row < 0 || formula->content.reference.row >= NUM_ROWS || 
-                formula->content.reference.col < 0 || formula->content.reference.col >= NUM_COLS) {
-                // Check if the cell reference is valid
-                fprintf(stderr, "Error: Invalid cell reference in formula\n"); // Print an error message
-                return 0.0; // Return 0.0 (double) as the result
-            }
-            Cell cell = spreadsheet[formula->content.reference.row][formula->content.reference.col]; // Retrieve the cell from the spreadsheet
-            if (cell.type == NUMBER) {
-                result += cell.content.number;
-            } else if (cell.type == FORMULA){
-                // Check if the cell is involved in a circular dependency
-                double formula_result = evaluate_formula(cell.content.formula); // Recursively evaluate the formula
-                result += formula_result; // Add the result of the formula to the result
-            } else {
-                // If the cell is not a number or a formula, treat it as 0 and warn the user
-                fprintf(stderr, "Warning: Non-numeric cell at [%d, %d] treated as 0 in formula\n", formula->content.reference.row, formula->content.reference.col); // Print a warning message
+            Cell *cell = referenced_cell(formula); // Retrieve the cell from its sheet
+            if (cell == NULL) {
+                // The cell reference is not valid
+                result.error = ERROR_REF;
+                return result;
+            }
+            if (cell->type == NUMBER) {
+                result.number += cell->content.number;
+            } else if (cell->type == FORMULA){
+                // Use the last computed value of the formula; update_dependents keeps it current
+                // Reading the cached value instead of recursing also stops circular formulas from looping forever
+                if (cell->value.error != ERROR_NONE) {
+                    result.error = cell->value.error; // Pass the error on
+                    return result;
+                }
+                result.number += cell->value.number;
+            } else if (cell->type == TEXT) {
+                // Text cannot be added
+                result.error = ERROR_VALUE;
+                return result;
             }
+            // Blank cells are treated as 0
         } else if (formula->type == CONSTANT) {
             // If the node represents a constant, add the constant value to the result
-            result += formula->content.constant;
+            result.number += formula->content.constant;
         }
         formula = formula->next; // Move to the next node in the formula linked list
     }
     return result; // Return the final result of the formula
 }
 
-// Update the dependents of a cell
-// This function is called when a cell is updated
-void update_dependents(ROW row, COL col, Cell **recalculation, int size) {
-    // Check if the row and col are within the valid range
-    if (row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
-        update_cell_display(row, col, "INVALID CELL");
+// Format a value the way it is displayed: errors by name, numbers with one decimal place
+void format_value(Value value, char *buffer, size_t size) {
+    switch (value.error) {
+        case ERROR_REF:
+            snprintf(buffer, size, "#REF!");
+            break;
+        case ERROR_VALUE:
+            snprintf(buffer, size, "#VALUE!");
+            break;
+        case ERROR_CIRC:
+            snprintf(buffer, size, "#CIRC!");
+            break;
+        default:
+            // Format the result as a string with one decimal place (VERY IMPORTANT for testing!)
+            snprintf(buffer, size, "%.1f", value.number);
+            break;
+    }
+}
+
+// Get the value of a referenced cell the way evaluate_formula sees it
+Value referenced_value(Cell *cell) {
+    Value result = {0.0, ERROR_NONE};
+    if (cell->type == NUMBER) {
+        result.number = cell->content.number;
+    } else if (cell->type == FORMULA) {
+        result = cell->value;
+    } else if (cell->type == TEXT) {
+        result.error = ERROR_VALUE;
+    }
+    return result; // Blank cells are treated as 0
+}
+
+// Get the text a cell displays: text as it is, numbers and formula values formatted into 'buffer' by format_value,
+// and "" for blank cells
+const char *format_cell(Cell *cell, char *buffer, size_t size) {
+    if (cell->type == TEXT) {
+        make_resident(cell->sheet);
+        return cell->content.text;
+    } else if (cell->type == BLANK) {
+        return "";
+    }
+    format_value(referenced_value(cell), buffer, size);
+    return buffer;
+}
+
+// Update the display of a cell, if it is on the active sheet and inside the display window
+// Other cells are not formatted at all: the interface fetches them with get_display_text once they are shown
+void display_cell(Cell *cell) {
+    if (cell->sheet != active) {
+        return;
+    }
+    int row, col;
+    physical_position(cell, &row, &col);
+    row = active->row_position[row];
+    col = active->col_position[col];
+    if (row < window_row || row >= window_row + window_rows || col < window_col || col >= window_col + window_cols) {
         return;
     }
-    Cell *cell = &spreadsheet[row][col];
+    char buffer[64];
+    update_cell_display(row, col, format_cell(cell, buffer, sizeof(buffer)));
+}
+
+// Fold the constants of a parsed formula and recognize its shape
+// Must be called again whenever the nodes of the formula change
+void compile_formula(Cell *cell) {
+    make_resident(cell->sheet);
+    Compiled *compiled = &cell->compiled;
+    int num_references = 0;
+    bool invalid = false; // An invalid reference comes before every valid one
+    bool generic = false; // An invalid reference comes after a valid one
+    compiled->constant = 0.0;
+    compiled->first = NULL;
+    compiled->second = NULL;
+
+    for (Node *node = cell->content.formula; node != NULL; node = node->next) {
+        if (node->type == CONSTANT) {
+            compiled->constant += node->content.constant;
+            continue;
+        }
+        Cell *referenced = referenced_cell(node);
+        if (referenced == NULL) {
+            // Errors come out in the order of the references, so an earlier reference's error wins over #REF!
+            invalid = invalid || num_references == 0;
+            generic = generic || num_references > 0;
+            continue;
+        }
+        num_references++;
+        if (num_references == 1) {
+            compiled->first = referenced;
+        } else if (num_references == 2) {
+            compiled->second = referenced;
+        }
+    }
+
+    if (invalid) {
+        compiled->shape = INVALID_REFERENCE;
+    } else if (generic) {
+        compiled->shape = GENERIC;
+    } else if (num_references == 0) {
+        compiled->shape = CONSTANT_ONLY;
+    } else if (num_references == 1) {
+        compiled->shape = compiled->constant == 0.0 ? ALIAS : REFERENCE_PLUS_CONSTANT;
+    } else if (num_references == 2) {
+        compiled->shape = TWO_REFERENCES;
+    } else {
+        compiled->shape = GENERIC;
+    }
+}
+
+// Evaluate the formula of a cell, through its compiled shape unless specialization is turned off
+Value evaluate_cell(Cell *cell) {
+    if (!specialization_enabled) {
+        make_resident(cell->sheet);
+        return evaluate_formula(cell->content.formula);
+    }
+
+    Compiled *compiled = &cell->compiled;
+    Value result = {compiled->constant, ERROR_NONE};
+    Value first, second;
+    switch (compiled->shape) {
+        case CONSTANT_ONLY:
+            return result;
+        case ALIAS:
+            return referenced_value(compiled->first);
+        case REFERENCE_PLUS_CONSTANT:
+            first = referenced_value(compiled->first);
+            first.number += compiled->constant;
+            return first;
+        case TWO_REFERENCES:
+            first = referenced_value(compiled->first);
+            if (first.error != ERROR_NONE) {
+                return first;
+            }
+            second = referenced_value(compiled->second);
+            if (second.error != ERROR_NONE) {
+                return second;
+            }
+            result.number = first.number + second.number + compiled->constant;
+            return result;
+        case INVALID_REFERENCE:
+            result.error = ERROR_REF;
+            return result;
+        default:
+            // Walk the references only; the constants are already folded
+            make_resident(cell->sheet);
+            for (Node *node = cell->content.formula; node != NULL; node = node->next) {
+                if (node->type == REFERENCE) {
+                    if (referenced_cell(node) == NULL) {
+                        result.error = ERROR_REF;
+                        return result;
+                    }
+                    Value referenced = referenced_value(referenced_cell(node));
+                    if (referenced.error != ERROR_NONE) {
+                        return referenced;
+                    }
+                    result.number += referenced.number;
+                }
+            }
+            return result;
+    }
+}
+
+// Add a formula cell and, before it, every formula cell it references to the recalculation order
+// The mark of a cell is 1 while its references are being visited and 2 once it is in the order
+void add_to_recalculation_order(Cell *cell, char *marks);
+
+// Add a formula cell referenced by the formula cell with the given index, if it is not in the order yet
+void visit_reference(Cell *referenced, int index, char *marks) {
+    if (referenced != NULL && referenced->type == FORMULA) {
+        if (marks[cell_index(referenced)] == 1) {
+            in_cycle[index] = true; // The reference leads back to a formula still being visited
+        } else {
+            add_to_recalculation_order(referenced, marks);
+        }
+    }
+}
+
+void add_to_recalculation_order(Cell *cell, char *marks) {
+    int index = cell_index(cell);
+    if (marks[index] != 0) {
+        return; // Already in the order
+    }
+    marks[index] = 1;
+    if (cell->compiled.shape == GENERIC || cell->compiled.shape == INVALID_REFERENCE) {
+        make_resident(cell->sheet);
+        for (Node *node = cell->content.formula; node != NULL; node = node->next) {
+            visit_reference(node->type == REFERENCE ? referenced_cell(node) : NULL, index, marks);
+        }
+    } else {
+        // The references of the other shapes are in the compiled formula, so a spilled sheet is not read back
+        visit_reference(cell->compiled.first, index, marks);
+        visit_reference(cell->compiled.second, index, marks);
+    }
+    marks[index] = 2;
+    recalculation_order[recalculation_order_length] = cell;
+    recalculation_order_index[recalculation_order_length] = index;
+    recalculation_order_length++;
+}
+
+// Update the pivots whose source range holds a cell whose value changed (defined with the pivots below)
+void notify_pivots(Cell *cell);
+
+// Give a cell of a pivot output that the user edits back to the user, so the pivot no longer writes to it
+void release_pivot_output(Cell *cell);
+
+// Recompute every pivot on a sheet from scratch, and free every pivot, or those of one sheet
+void rebuild_pivots(Sheet *sheet);
+void free_pivots();
+void free_sheet_pivots(Sheet *sheet);
+
+// Free every scenario, or those reading cells of one sheet (defined with the scenarios below)
+void free_scenarios();
+void free_sheet_scenarios(Sheet *sheet);
+
+// Free the text, formulas and dependents lists held by the cells of a sheet
+// Cells of other sheets are not touched, so this works when every sheet is being freed
+void free_cells(Sheet *sheet) {
+    for (int i = 0; i < NUM_ROWS; i++) {
+        for (int j = 0; j < NUM_COLS; j++) {
+            Cell *cell = &sheet->cells[i][j];
+            // A spilled sheet holds none of its text and formulas in memory; their pointers are NULL
+            if (cell->type == TEXT) {
+                free(cell->content.text);
+            } else if (cell->type == FORMULA) {
+                free_formula(cell->content.formula);
+                free(cell->original_formula);
+            }
+            free(cell->dependents);
+        }
+    }
+}
+
+// Recalculate every formula in order, as recalculate_all does (defined below)
+// Returns true if any value changed
+bool recalculate_formulas();
+
+// Update the dependents of a cell
+// This function is called when a cell is updated
+// Dependents on other sheets are recalculated too, but only cells on the active sheet are displayed
+// Returns false if a circular reference was found; every formula has then been recalculated and there is nothing
+// left to update
+bool update_dependents(Cell *cell, Cell **recalculation, int size) {
     // Check for circular dependency
     for (int i = 0; i < size; i++) {
         if (recalculation[i] == cell) {
-            // Supposed to update the cell display to show circular error message
-            // Could not get this function to work properly
-            is_circular_dependency(cell, recalculation, size);
-            update_cell_display(row, col, "CIRCULAR ERROR");
-            return;
+            // Every formula on the cycle has to become #CIRC!, not just this one, and the formulas depending on
+            // them have to pick up the error, which is what the recalculation order works out
+            recalculate_formulas();
+            return false;
         }
     }
-    // Check if the cell is valid
-    if (cell == NULL) {
-        update_cell_display(row, col, "INVALID CELL"); // Update the cell display to show the error message
-        return;
-    }
 
     recalculation[size] = cell;
 
@@ -227,97 +916,125 @@ void update_dependents(ROW row, COL col, Cell **recalculation, int size) {
     for (int i = 0; i < cell->num_dependents; i++) {
         // Get a pointer to the dependent cell with type Cell struct 
         Cell *dependent = cell->dependents[i];
-        int dependent_row, dependent_col;
-
-        // Find the row and column of the dependent cell in the spreadsheet
-        for (dependent_row = 0; dependent_row < NUM_ROWS; dependent_row++) {
-            for (dependent_col = 0; dependent_col < NUM_COLS; dependent_col++) {
-                if (&spreadsheet[dependent_row][dependent_col] == dependent) {
-                    break;
-                }
-            }
-            if (dependent_col < NUM_COLS) {
-                break;
-            }
-        }
 
         // Recalculate the value of the dependent cell if it contains a formula
         if (dependent->type == FORMULA) {
-            double formula_result = evaluate_formula(dependent->content.formula);
-            dependent->content.number = formula_result; // Update the number, keep the type as FORMULA
+            dependent->value = evaluate_cell(dependent); // Update the value, keep the type as FORMULA
 
             // Update the display of the dependent cell with the new value
-            char result_str[64];
-            // Format the result as a string with one decimal place (VERY IMPORTANT!)
-            snprintf(result_str, sizeof(result_str), "%.1f", formula_result);
-            update_cell_display(dependent_row, dependent_col, result_str);
+            display_cell(dependent);
+            notify_pivots(dependent);
         }
 
         // Recursively update the dependents of the dependent cell
-        if (size < 70) {
-            // If the array size is less than 70, call the function recursively
-            update_dependents(dependent_row, dependent_col, recalculation, (size + 1));
+        if (size + 1 < MAX_RECALCULATION_DEPTH) {
+            // If the chain is not too long, call the function recursively
+            if (!update_dependents(dependent, recalculation, (size + 1))) {
+                return false;
+            }
         } else {
-            // If the array size is too large, print an error message and return
-            fprintf(stderr, "Error: Size too large\n");
-            return;
+            // If the array size is too large, report it and return
+            diagnostic("Error: Size too large");
+            return true;
         }
     }
+    return true;
 }
 
-// Initialize the spreadsheet
-void model_init() {
-    for (int i = 0; i < NUM_ROWS; i++) {
-        for (int j = 0; j < NUM_COLS; j++) {
-            spreadsheet[i][j].type = BLANK; // Set cell type to BLANK
-            spreadsheet[i][j].content.text = NULL; // Set content text to NULL
-            spreadsheet[i][j].original_formula = NULL; // Set original formula to NULL
-            spreadsheet[i][j].dependents = NULL; // Set dependents to NULL
-            spreadsheet[i][j].num_dependents = 0; // Set number of dependents to 0
+// Returns true if a name can be used as a sheet name: letters, digits and underscores, so that it can be
+// written in front of a reference
+bool valid_sheet_name(const char *name) {
+    size_t length = strlen(name);
+    if (length == 0 || length >= SHEET_NAME_LENGTH) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (!isalnum(name[i]) && name[i] != '_') {
+            return false;
         }
     }
+    return true;
 }
 
-// Helper function to free memory for a formula linked list
-// It takes in a pointer to the head of the linked list as a parameter
-void free_formula(Node *formula) {
-    while (formula != NULL) {
-        Node *temp = formula;
-        formula = formula->next;
-        free(temp);
+// Add a name to the workbook without allocating its sheet
+// Returns the index of the new sheet, or -1 if the name is invalid or taken or the workbook is full
+int register_sheet(const char *name) {
+    if (!valid_sheet_name(name) || num_sheets == MAX_SHEETS || find_sheet(name) >= 0) {
+        return -1;
     }
+    strcpy(sheet_names[num_sheets], name);
+    sheets[num_sheets] = NULL;
+    return num_sheets++;
 }
 
-// Function to update the value of a cell
-void set_cell_value(ROW row, COL col, char *text) {
-    // Handle the NULL case for text
-    if (text == NULL) {
-        clear_cell(row, col);
-        return;
+// Initialize the workbook with a single blank sheet
+void model_init() {
+    free_pivots();
+    free_scenarios();
+    for (int i = 1; i < num_sheets; i++) {
+        snapshot_withdraw(i); // The first sheet gets a blank snapshot below
+    }
+    for (int i = 0; i < num_sheets; i++) {
+        if (sheets[i] != NULL) {
+            free_cells(sheets[i]);
+            free(sheets[i]);
+            sheets[i] = NULL;
+        }
+    }
+    num_sheets = 0;
+    recalculation_order_valid = false;
+    resident_bytes = 0;
+    clock_hand = 0;
+    resident_hits = 0;
+    resident_misses = 0;
+    evictions = 0;
+    if (spill_is_open()) {
+        spill_clear();
+    }
+
+    int index = register_sheet(DEFAULT_SHEET_NAME);
+    sheets[index] = new_sheet(index);
+    active = sheets[index];
+    commit_snapshot(); // Readers start from an all-blank snapshot
+}
+
+// Function to update the value of a cell on any sheet
+// The cell is only displayed if it is on the active sheet
+void assign_cell(Cell *cell, char *text) {
+    make_resident(cell->sheet);
+    size_t payload_before = cell_payload_bytes(cell);
+
+    // Adding, replacing or removing a formula changes the recalculation order
+    if (cell->type == FORMULA || text[0] == '=') {
+        recalculation_order_valid = false;
     }
 
     // Check if the text is a formula 
     if (text[0] == '=') {
         // Free existing memory if there is already a formula in the cell
-        if (spreadsheet[row][col].type == FORMULA) {
-            free_formula(spreadsheet[row][col].content.formula); // Free memory for the formula linked list
-            free(spreadsheet[row][col].original_formula); // Free memory for the original formula string
+        if (cell->type == FORMULA) {
+            drop_formula(cell); // Free memory for the formula and stop depending on what it referenced
+        } else if (cell->type == TEXT) {
+            free(cell->content.text);
         }
         // Store the original formula string
-        spreadsheet[row][col].original_formula = strdup(text);
+        cell->original_formula = strdup(text);
 
         // Parse, evaluate and update display for the formula
-        Node *formula = parse_formula(text, row, col);
-        spreadsheet[row][col].type = FORMULA; // Set the cell type to FORMULA
-        spreadsheet[row][col].content.formula = formula; // Store the parsed formula
+        Node *formula = parse_formula(text, cell);
+        cell->type = FORMULA; // Set the cell type to FORMULA
+        cell->content.formula = formula; // Store the parsed formula
+        compile_formula(cell); // Fold constants and pick a specialized evaluator
 
         // Evaluate the formula and update the display
-        double formula_result = evaluate_formula(formula);
-        char result_str[64];
-        // Format the result as a string with one decimal place (VERY IMPORTANT for testing!)
-        snprintf(result_str, sizeof(result_str), "%.1f", formula_result);
-        update_cell_display(row, col, result_str);
+        cell->value = evaluate_cell(cell); // Cache the result for cells that reference this one
+        display_cell(cell);
     } else {
+        // A formula being replaced by a constant no longer depends on anything
+        if (cell->type == FORMULA) {
+            drop_formula(cell);
+            cell->type = BLANK;
+        }
         char *endptr;
         // strtod converts a string to a double
         double number = strtod(text, &endptr);
@@ -325,60 +1042,472 @@ void set_cell_value(ROW row, COL col, char *text) {
         // Check if the entire string was a valid number
         if (*endptr == '\0') {
             // It's a number
-            spreadsheet[row][col].type = NUMBER;
-            spreadsheet[row][col].content.number = number;
-            char number_str[64];
-            snprintf(number_str, sizeof(number_str), "%.1f", number);
-            update_cell_display(row, col, number_str);
+            if (cell->type == TEXT) {
+                free(cell->content.text);
+            }
+            cell->type = NUMBER;
+            cell->content.number = number;
+            display_cell(cell);
         } else {
             // It's text
             // Free existing memory if there is already text in the cell
-            if (spreadsheet[row][col].type == TEXT && spreadsheet[row][col].content.text != NULL) {
-                free(spreadsheet[row][col].content.text);
+            if (cell->type == TEXT && cell->content.text != NULL) {
+                free(cell->content.text);
             }
 
             // Allocate memory for new text and copy it
-            spreadsheet[row][col].content.text = malloc(strlen(text) + 1);
-            strcpy(spreadsheet[row][col].content.text, text);
-            if (spreadsheet[row][col].content.text == NULL) {
+            cell->content.text = malloc(strlen(text) + 1);
+            if (cell->content.text == NULL) {
                 fprintf(stderr, "Memory allocation failed for cell text\n");
                 exit(1);
             }
+            strcpy(cell->content.text, text);
             // Set the cell type to TEXT
-            spreadsheet[row][col].type = TEXT;
-            update_cell_display(row, col, text);
+            cell->type = TEXT;
+            display_cell(cell);
         }
     }
+    account_payload(cell->sheet, payload_before, cell_payload_bytes(cell));
+    notify_pivots(cell);
+
     // Update the dependents of the cell
-    Cell *recalculation[70]; // Maximum number of cells in the spreadsheet will always be 70 since it is fixed
-    update_dependents(row, col, recalculation, 0); // We start with an empty array and update it through recursion
+    Cell *recalculation[MAX_RECALCULATION_DEPTH];
+    update_dependents(cell, recalculation, 0); // We start with an empty array and update it through recursion
 }
 
-// Free memory for the cell and reset it to type BLANK and text NULL
-void clear_cell(ROW row, COL col) {
+// Function to update the value of a cell of the active sheet
+void set_cell_value(ROW row, COL col, char *text) {
+    // Handle the NULL case for text
+    if (text == NULL) {
+        clear_cell(row, col);
+        return;
+    }
     // Determine if the cell is valid
     if (row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
         return;
     }
-    
-    Cell *cell = &spreadsheet[row][col];
+
+    // Record the edit before applying it, so it can be replayed after a crash
+    journal_log_set(row, col, text);
+
+    release_pivot_output(cell_at(row, col));
+    assign_cell(cell_at(row, col), text);
+    commit_snapshot(); // Make the recalculated values visible to readers
+    enforce_memory_budget();
+}
+
+// Function to set a cell of a sheet that is being loaded from the snapshot
+// Nothing is journaled, since the cell is already in the snapshot
+void load_sheet_cell(int sheet, ROW row, COL col, char *text) {
+    if (sheet < 0 || sheet >= num_sheets || sheets[sheet] == NULL || text == NULL ||
+        row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
+        return;
+    }
+    Sheet *loading = sheets[sheet];
+    assign_cell(&loading->cells[loading->row_map[row]][loading->col_map[col]], text);
+}
+
+// Free the memory held by a cell and reset it to type BLANK
+// The list of cells that depend on it is left alone
+void reset_cell(Cell *cell) {
+    make_resident(cell->sheet);
+    account_payload(cell->sheet, cell_payload_bytes(cell), 0);
 
     // Free memory based on the type of the cell and reset it
     if (cell->type == TEXT && cell->content.text != NULL) {
         free(cell->content.text);
-    } else if (cell->type == FORMULA && cell->content.formula != NULL) {
-        free_formula(cell->content.formula);
-        free(cell->original_formula);
+    } else if (cell->type == FORMULA) {
+        drop_formula(cell);
     }
 
     // Reset the cell
     cell->type = BLANK;
     cell->content.text = NULL; // Applicable to both TEXT and FORMULA
-    cell->num_dependents = 0; // Reset the number of dependents
     cell->original_formula = NULL; // Reset the original formula
+    cell->value = (Value) {0.0, ERROR_NONE}; // Reset the formula value
 }
 
-// Function to retrieve the textual value of a cell
+// Free memory for the cell and reset it to type BLANK and text NULL
+void clear_cell(ROW row, COL col) {
+    // Determine if the cell is valid
+    if (row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
+        return;
+    }
+    journal_log_clear(row, col); // Record the edit before applying it
+    
+    Cell *cell = cell_at(row, col);
+    release_pivot_output(cell);
+    reset_cell(cell);
+    display_cell(cell);
+    notify_pivots(cell);
+    // Formulas referencing the cell keep referencing it, and now see a blank cell
+    Cell *recalculation[MAX_RECALCULATION_DEPTH];
+    update_dependents(cell, recalculation, 0);
+    commit_snapshot(); // Make the cleared cell visible to readers
+    enforce_memory_budget();
+}
+
+// Recalculate every formula in the loaded sheets, each after the formulas it references
+// Only cells whose value changes are redisplayed, and a new snapshot is only published if something changed
+bool recalculate_formulas() {
+    if (!recalculation_order_valid) {
+        static char marks[MAX_SHEETS * SHEET_CELLS];
+        memset(marks, 0, sizeof(marks));
+        memset(in_cycle, 0, sizeof(in_cycle));
+        recalculation_order_length = 0;
+        for (int s = 0; s < num_sheets; s++) {
+            if (sheets[s] == NULL) {
+                continue; // Unloaded sheets have no formulas in memory
+            }
+            for (int i = 0; i < NUM_ROWS; i++) {
+                for (int j = 0; j < NUM_COLS; j++) {
+                    if (sheets[s]->cells[i][j].type == FORMULA) {
+                        add_to_recalculation_order(&sheets[s]->cells[i][j], marks);
+                    }
+                }
+            }
+        }
+        recalculation_order_valid = true;
+    }
+
+    bool changed = false;
+    for (int k = 0; k < recalculation_order_length; k++) {
+        Cell *cell = recalculation_order[k];
+        int index = recalculation_order_index[k];
+        Value value = {0.0, ERROR_CIRC};
+        if (!in_cycle[index]) {
+            value = evaluate_cell(cell);
+        }
+        if (value.number != cell->value.number || value.error != cell->value.error) {
+            cell->value = value;
+            display_cell(cell);
+            notify_pivots(cell);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void recalculate_all() {
+    if (recalculate_formulas()) {
+        commit_snapshot();
+    }
+    enforce_memory_budget();
+}
+
+// Turn the specialized formula evaluators on or off
+void set_formula_specialization(bool enabled) {
+    specialization_enabled = enabled;
+}
+
+// Update the display of every cell from the logical rows and columns given onwards
+// Called after a structural edit, since the cells shown at those positions have changed
+void refresh_display(int first_row, int first_col) {
+    for (int i = first_row; i < NUM_ROWS; i++) {
+        for (int j = first_col; j < NUM_COLS; j++) {
+            display_cell(cell_at(i, j)); // Cells outside the display window are skipped
+        }
+    }
+}
+
+// Limit the cells whose changes are pushed to the interface
+void set_display_window(ROW first_row, COL first_col, int rows, int cols) {
+    window_row = first_row;
+    window_col = first_col;
+    window_rows = rows;
+    window_cols = cols;
+}
+
+// Get the text a cell of the active sheet displays, for cells the interface did not have pushed to it
+void get_display_text(ROW row, COL col, char *buffer, size_t size) {
+    if (row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
+        buffer[0] = '\0';
+        return;
+    }
+    char formatted[64];
+    snprintf(buffer, size, "%s", format_cell(cell_at(row, col), formatted, sizeof(formatted)));
+}
+
+// Turn every reference to a physical row (or column, if is_row is false) of the active sheet that is being deleted into #REF!
+// Only the formulas listed as dependents of the deleted cells are touched, and they are recalculated
+void invalidate_references(int physical, bool is_row) {
+    int count = is_row ? NUM_COLS : NUM_ROWS;
+    for (int k = 0; k < count; k++) {
+        Cell *deleted = is_row ? &active->cells[physical][k] : &active->cells[k][physical];
+        for (int i = 0; i < deleted->num_dependents; i++) {
+            Cell *dependent = deleted->dependents[i];
+            if (dependent->type != FORMULA) {
+                continue; // The dependents list can hold cells that no longer have a formula
+            }
+            make_resident(dependent->sheet);
+            bool changed = false;
+            for (Node *node = dependent->content.formula; node != NULL; node = node->next) {
+                if (node->type == REFERENCE && node->content.reference.sheet == active &&
+                    node->content.reference.col != DELETED_REFERENCE &&
+                    (is_row ? node->content.reference.row : node->content.reference.col) == physical) {
+                    node->content.reference.row = DELETED_REFERENCE;
+                    node->content.reference.col = DELETED_REFERENCE;
+                    changed = true;
+                }
+            }
+            if (!changed) {
+                continue;
+            }
+            dependent->sheet->spill_valid = false; // The nodes changed
+
+            // Recalculate the formula and everything depending on it
+            compile_formula(dependent); // The shape changes now that a reference is invalid
+            dependent->value = evaluate_cell(dependent);
+            display_cell(dependent);
+            notify_pivots(dependent);
+            Cell *recalculation[MAX_RECALCULATION_DEPTH];
+            update_dependents(dependent, recalculation, 0);
+        }
+        free(deleted->dependents);
+        deleted->dependents = NULL;
+        deleted->num_dependents = 0;
+    }
+}
+
+// Returns true if every cell of a logical row (or column, if is_row is false) is blank
+bool is_blank_line(int logical, bool is_row) {
+    int count = is_row ? NUM_COLS : NUM_ROWS;
+    for (int k = 0; k < count; k++) {
+        Cell *cell = is_row ? cell_at(logical, k) : cell_at(k, logical);
+        if (cell->type != BLANK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Move the map entry at position 'from' to position 'to', shifting the entries in between
+// Then fix up the inverse map for every position that moved
+void move_map_entry(int *map, int *position, int from, int to) {
+    int moved = map[from];
+    if (from < to) {
+        memmove(&map[from], &map[from + 1], (to - from) * sizeof(int));
+    } else {
+        memmove(&map[to + 1], &map[to], (from - to) * sizeof(int));
+    }
+    map[to] = moved;
+    int first = from < to ? from : to;
+    int last = from < to ? to : from;
+    for (int i = first; i <= last; i++) {
+        position[map[i]] = i;
+    }
+}
+
+// Insert a blank row before the given row, shifting the rows below it down
+// The sheet has a fixed size, so this fails if the last row is not blank
+// References to the last row become #REF!, since it is pushed off the sheet
+bool insert_row(ROW row) {
+    if (row < 0 || row >= NUM_ROWS || !is_blank_line(NUM_ROWS - 1, true)) {
+        return false;
+    }
+    journal_log_insert_row(row);
+    load_referring_sheets();
+    // The blank last row becomes the new row; no other cell or reference moves
+    invalidate_references(active->row_map[NUM_ROWS - 1], true);
+    move_map_entry(active->row_map, active->row_position, NUM_ROWS - 1, row);
+    refresh_display(row, 0);
+    rebuild_pivots(active); // Their ranges now hold other cells
+    commit_snapshot();
+    enforce_memory_budget();
+    return true;
+}
+
+// Delete a row, shifting the rows below it up and leaving a blank last row
+// References to cells in the deleted row become #REF!
+bool delete_row(ROW row) {
+    if (row < 0 || row >= NUM_ROWS) {
+        return false;
+    }
+    journal_log_delete_row(row);
+    load_referring_sheets();
+    int physical = active->row_map[row];
+    invalidate_references(physical, true);
+    for (int j = 0; j < NUM_COLS; j++) {
+        reset_cell(&active->cells[physical][j]);
+    }
+    // Reuse the emptied physical row as the new blank last row
+    move_map_entry(active->row_map, active->row_position, row, NUM_ROWS - 1);
+    refresh_display(row, 0);
+    rebuild_pivots(active); // Their ranges now hold other cells
+    commit_snapshot();
+    enforce_memory_budget();
+    return true;
+}
+
+// Insert a blank column before the given column, shifting the columns to its right
+// The sheet has a fixed size, so this fails if the last column is not blank
+// References to the last column become #REF!, since it is pushed off the sheet
+bool insert_col(COL col) {
+    if (col < 0 || col >= NUM_COLS || !is_blank_line(NUM_COLS - 1, false)) {
+        return false;
+    }
+    journal_log_insert_col(col);
+    load_referring_sheets();
+    invalidate_references(active->col_map[NUM_COLS - 1], false);
+    move_map_entry(active->col_map, active->col_position, NUM_COLS - 1, col);
+    refresh_display(0, col);
+    rebuild_pivots(active); // Their ranges now hold other cells
+    commit_snapshot();
+    enforce_memory_budget();
+    return true;
+}
+
+// Delete a column, shifting the columns to its right left and leaving a blank last column
+// References to cells in the deleted column become #REF!
+bool delete_col(COL col) {
+    if (col < 0 || col >= NUM_COLS) {
+        return false;
+    }
+    journal_log_delete_col(col);
+    load_referring_sheets();
+    int physical = active->col_map[col];
+    invalidate_references(physical, false);
+    for (int i = 0; i < NUM_ROWS; i++) {
+        reset_cell(&active->cells[i][physical]);
+    }
+    move_map_entry(active->col_map, active->col_position, col, NUM_COLS - 1);
+    refresh_display(0, col);
+    rebuild_pivots(active); // Their ranges now hold other cells
+    commit_snapshot();
+    enforce_memory_budget();
+    return true;
+}
+
+// Physical column used as the sort key by compare_rows, and the sort direction
+int sort_key_col;
+bool sort_ascending;
+
+// Rank of a cell when sorting: numbers, text, errors, then blanks
+int sort_rank(Cell *cell) {
+    switch (cell->type) {
+        case NUMBER:
+            return 0;
+        case FORMULA:
+            return cell->value.error == ERROR_NONE ? 0 : 2;
+        case TEXT:
+            return 1;
+        default:
+            return 3;
+    }
+}
+
+// Compare two physical rows by the cell in the key column
+// Numbers (and formula results) come before text, then errors, and blank cells always come last
+int compare_rows(const void *a, const void *b) {
+    int row_a = *(const int *) a;
+    int row_b = *(const int *) b;
+    Cell *cell_a = &active->cells[row_a][sort_key_col];
+    Cell *cell_b = &active->cells[row_b][sort_key_col];
+    int rank_a = sort_rank(cell_a);
+    int rank_b = sort_rank(cell_b);
+    int result = 0;
+    if (rank_a != rank_b) {
+        return rank_a - rank_b; // Not affected by the sort direction
+    }
+    if (rank_a == 0) {
+        double value_a = cell_a->type == NUMBER ? cell_a->content.number : cell_a->value.number;
+        double value_b = cell_b->type == NUMBER ? cell_b->content.number : cell_b->value.number;
+        result = (value_a > value_b) - (value_a < value_b);
+    } else if (rank_a == 1) {
+        result = strcmp(cell_a->content.text, cell_b->content.text);
+    }
+    if (!sort_ascending) {
+        result = -result;
+    }
+    if (result == 0) {
+        result = active->row_position[row_a] - active->row_position[row_b]; // Keep equal rows in their current order
+    }
+    return result;
+}
+
+// Sort the rows from first to last (inclusive) by the value in the key column
+// Only the row map is permuted; references follow the rows they point to
+bool sort_rows(ROW first, ROW last, COL key, bool ascending) {
+    if (first < 0 || last >= NUM_ROWS || first > last || key < 0 || key >= NUM_COLS) {
+        return false;
+    }
+    journal_log_sort_rows(first, last, key, ascending);
+    load_referring_sheets();
+    sort_key_col = active->col_map[key];
+    sort_ascending = ascending;
+    qsort(&active->row_map[first], last - first + 1, sizeof(int), compare_rows);
+    for (int i = first; i <= (int) last; i++) {
+        active->row_position[active->row_map[i]] = i;
+    }
+    refresh_display(first, 0);
+    rebuild_pivots(active); // Their ranges now hold other cells
+    commit_snapshot();
+    enforce_memory_budget();
+    return true;
+}
+
+// Write a formula with its references at their current logical positions
+// The original text is copied, and each reference in it is replaced by the address of the cell it now points to,
+// walking the text exactly like parse_formula does so that references and nodes line up
+// A sheet name in front of a reference is kept as it was typed
+char *render_formula(Cell *cell) {
+    make_resident(cell->sheet);
+    const char *ptr = cell->original_formula;
+    Node *node = cell->content.formula;
+    // A reference is at least one character and is replaced by at most "#REF!" or a column letter and a row number
+    char *result = malloc(strlen(ptr) * 16 + 1);
+    if (result == NULL) {
+        return NULL;
+    }
+    size_t length = 0;
+
+    while (*ptr) {
+        if (isalpha(*ptr)) {
+            const char *start = ptr;
+            const char *name_end = ptr;
+            while (isalnum(*name_end) || *name_end == '_') name_end++;
+            if (*name_end == '!') {
+                ptr = name_end + 1;
+            }
+            const char *address = ptr;
+            if (isalpha(*ptr)) ptr++;
+            while (isdigit(*ptr)) ptr++;
+            // Skip over constants until the node of this reference
+            while (node != NULL && node->type != REFERENCE) node = node->next;
+            Cell *referenced = node != NULL ? referenced_cell(node) : NULL;
+            if (node != NULL && node->content.reference.col == DELETED_REFERENCE) {
+                memcpy(result + length, start, address - start);
+                length += address - start;
+                length += sprintf(result + length, "#REF!");
+            } else if (referenced != NULL) {
+                Sheet *sheet = referenced->sheet;
+                int row, col;
+                physical_position(referenced, &row, &col);
+                memcpy(result + length, start, address - start); // The sheet name, if any
+                length += address - start;
+                length += sprintf(result + length, "%c%d", 'A' + sheet->col_position[col], sheet->row_position[row] + 1);
+            } else {
+                // Invalid references are kept as they were typed
+                memcpy(result + length, start, ptr - start);
+                length += ptr - start;
+            }
+            if (node != NULL) node = node->next;
+        } else if (isdigit(*ptr) || *ptr == '.') {
+            // Copy constants as typed, using the same rule as the parser to find where they end
+            const char *start = ptr;
+            strtod(ptr, (char **)&ptr);
+            if (ptr == start) ptr++;
+            memcpy(result + length, start, ptr - start);
+            length += ptr - start;
+        } else {
+            result[length++] = *ptr++;
+        }
+    }
+    result[length] = '\0';
+    return result;
+}
+
+// Function to retrieve the textual value of a cell
 // Returns a string representing the value of the cell at the given coordinates
 // It takes in the row and column of the cell as parameters.
 // It returns a string representing the value of the cell at the given coordinates.
@@ -396,7 +1525,7 @@ char *get_textual_value(ROW row, COL col) {
         return errorMessage;
     }
     // Access the cell from the spreadsheet using the provided row and column indices
-    Cell *cell = &(spreadsheet[row][col]);
+    Cell *cell = cell_at(row, col);
     char *result;
     
     // Switch case to handle different types of cell content
@@ -422,7 +1551,7 @@ char *get_textual_value(ROW row, COL col) {
         case FORMULA:
             // Check if the formula cell has an original formula
             if (cell->original_formula != NULL) {
-                result = strdup(cell->original_formula); // Duplicate the original formula string
+                result = render_formula(cell); // Rewrite the references for the current row and column order
             } else {
                 result = strdup("Error: Empty formula cell"); // Return an error message for an empty formula cell
             }
@@ -441,6 +1570,1278 @@ char *get_textual_value(ROW row, COL col) {
     return result;
 }
 
+// Function to retrieve the text that recreates a cell of any loaded sheet, used when saving the workbook
+// Returns NULL for blank cells, unloaded sheets and invalid coordinates
+char *get_sheet_input_value(int sheet, ROW row, COL col) {
+    if (sheet < 0 || sheet >= num_sheets || sheets[sheet] == NULL ||
+        row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
+        return NULL;
+    }
+    Cell *cell = &sheets[sheet]->cells[sheets[sheet]->row_map[row]][sheets[sheet]->col_map[col]];
+    char *result = NULL;
+    make_resident(cell->sheet);
+
+    switch (cell->type) {
+        case TEXT:
+            if (cell->content.text != NULL) {
+                result = strdup(cell->content.text);
+            }
+            break;
+        case NUMBER:
+            result = malloc(64 * sizeof(char));
+            if (result != NULL) {
+                // 17 significant digits are enough to read back the exact same double
+                snprintf(result, 64, "%.17g", cell->content.number);
+            }
+            break;
+        case FORMULA:
+            if (cell->original_formula != NULL) {
+                result = render_formula(cell);
+            }
+            break;
+        default:
+            break; // Blank cells have nothing to save
+    }
+    return result;
+}
+
+// Function to retrieve the text that recreates a cell of the active sheet
+char *get_input_value(ROW row, COL col) {
+    return get_sheet_input_value(active->index, row, col);
+}
+
+// Find a sheet of the workbook by name, returning its index or -1
+int find_sheet(const char *name) {
+    return find_sheet_name(name, strlen(name));
+}
+
+// Add a blank sheet to the end of the workbook
+int add_sheet(const char *name) {
+    int index = register_sheet(name);
+    if (index < 0) {
+        return -1;
+    }
+    journal_log_add_sheet(name);
+    sheets[index] = new_sheet(index);
+    return index;
+}
+
+// Add a sheet whose cells are only loaded from the snapshot when it is first used
+// If a sheet of that name already exists, it must still be blank; it is unloaded unless it is the active sheet
+int add_unloaded_sheet(const char *name) {
+    int index = find_sheet(name);
+    if (index < 0) {
+        return register_sheet(name);
+    }
+    if (sheets[index] != NULL && sheets[index] != active) {
+        // The sheet is replaced by the one in the snapshot, so drop everything that points into it
+        Sheet *sheet = sheets[index];
+        free_sheet_pivots(sheet);
+        free_sheet_scenarios(sheet);
+        for (int i = 0; i < NUM_ROWS; i++) {
+            for (int j = 0; j < NUM_COLS; j++) {
+                reset_cell(&sheet->cells[i][j]); // Cells of other sheets stop listing its formulas as dependents
+            }
+        }
+        free_cells(sheet);
+        free(sheet);
+        sheets[index] = NULL;
+    }
+    return index;
+}
+
+int sheet_count() {
+    return num_sheets;
+}
+
+const char *sheet_name(int sheet) {
+    if (sheet < 0 || sheet >= num_sheets) {
+        return NULL;
+    }
+    return sheet_names[sheet];
+}
+
+bool is_sheet_loaded(int sheet) {
+    return sheet >= 0 && sheet < num_sheets && sheets[sheet] != NULL;
+}
+
+int active_sheet() {
+    return active->index;
+}
+
+// Show and edit another sheet, loading it first if it has not been used yet
+// Every cell is redisplayed and readers get a snapshot of the new sheet
+bool activate_sheet(int sheet) {
+    if (sheet < 0 || sheet >= num_sheets) {
+        return false;
+    }
+    journal_log_activate_sheet(sheet_names[sheet]);
+    active = use_sheet(sheet);
+    make_resident(active); // The active sheet stays in memory
+    refresh_display(0, 0);
+    commit_snapshot();
+    enforce_memory_budget();
+    return true;
+}
+
+
+// Pivots: live group-by aggregations of a range of a sheet (see add_pivot)
+// Every source row adds its value to the group of its key. Groups are kept in an array in the order they were
+// created, and found through an open addressing hash table of their indices. When a source cell changes,
+// only the groups the row leaves and joins are updated, and only their output cells are rewritten,
+// unless a group appears or becomes empty and the output has to be laid out again
+// Empty groups are dropped when the hash table fills up, so keys that come and go do not use more and more memory
+
+// A key of a pivot group: a number, or text interned so that equal text is the same pointer
+typedef struct Key {
+    bool is_text;
+    double number;
+    const char *text;
+} Key;
+
+// Defines a struct called Group, which is one row of a pivot's output
+typedef struct Group {
+    Key key;
+    double sum; // Sum of the numeric values
+    double min;
+    double max;
+    int rows; // Rows with this key
+    int numbers; // Rows with a numeric value
+    int errors; // Rows whose value is an error
+    CELL_ERROR error; // Error of the last such row
+    int output_row; // Row of the output showing this group, or -1
+} Group;
+
+typedef struct Pivot {
+    Sheet *sheet;
+    PivotSpec spec;
+    int row_group[NUM_ROWS]; // Group of each source row, or -1 if its key cell is blank
+    Value row_value[NUM_ROWS]; // Value of each source row
+    bool row_numeric[NUM_ROWS]; // Whether that value is a number (text and blank values are not aggregated)
+    Group *groups;
+    int num_groups;
+    int groups_capacity;
+    int *slots; // Hash table of group indices, -1 for an empty slot; its size is a power of two
+    int num_slots;
+    Cell *output[NUM_ROWS][2]; // Key and result cells the pivot owns, or NULL where a cell belongs to the user
+    int output_rows;
+    bool updating; // Set while the pivot writes its output, so a pivot cannot update itself
+} Pivot;
+
+Pivot *pivots[MAX_PIVOTS];
+int num_pivots = 0;
+
+// Interned text: an open addressing hash table holding one copy of each distinct key text
+char **interned = NULL;
+int interned_slots = 0;
+int interned_count = 0;
+
+// FNV-1a hash of a string
+uint64_t hash_text(const char *text) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *text; text++) {
+        hash = (hash ^ (unsigned char) *text) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Mix the bits of a 64-bit number so that nearby numbers land in different slots
+uint64_t hash_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return bits;
+}
+
+// Find the slot of an interned text in a table of interned texts, or the empty slot where it would go
+int find_interned(char **table, int num_slots, const char *text) {
+    int slot = (int) (hash_text(text) & (num_slots - 1));
+    while (table[slot] != NULL && table[slot] != text) {
+        slot = (slot + 1) & (num_slots - 1);
+    }
+    return slot;
+}
+
+// Get the interned copy of a text
+// When the table fills up, the texts that are no longer the key of any group are freed first
+const char *intern(const char *text) {
+    if ((interned_count + 1) * 2 > interned_slots) {
+        int keys = 0;
+        for (int i = 0; i < num_pivots; i++) {
+            keys += pivots[i]->num_groups;
+        }
+        // Leave room for at least as many new texts as are kept before this is done again
+        int num_slots = 64;
+        while ((keys + 1) * 4 > num_slots) {
+            num_slots *= 2;
+        }
+        char **kept = calloc(num_slots, sizeof(char *));
+        if (kept == NULL) {
+            fprintf(stderr, "Memory allocation failed for interned text\n");
+            exit(1);
+        }
+        interned_count = 0;
+        for (int i = 0; i < num_pivots; i++) {
+            for (int g = 0; g < pivots[i]->num_groups; g++) {
+                Key *key = &pivots[i]->groups[g].key;
+                if (key->is_text) {
+                    int slot = find_interned(kept, num_slots, key->text);
+                    if (kept[slot] == NULL) {
+                        kept[slot] = (char *) key->text;
+                        interned_count++;
+                    }
+                }
+            }
+        }
+        for (int i = 0; i < interned_slots; i++) {
+            if (interned[i] != NULL && kept[find_interned(kept, num_slots, interned[i])] == NULL) {
+                free(interned[i]);
+            }
+        }
+        free(interned);
+        interned = kept;
+        interned_slots = num_slots;
+    }
+    int slot = (int) (hash_text(text) & (interned_slots - 1));
+    while (interned[slot] != NULL) {
+        if (strcmp(interned[slot], text) == 0) {
+            return interned[slot];
+        }
+        slot = (slot + 1) & (interned_slots - 1);
+    }
+    interned[slot] = strdup(text);
+    if (interned[slot] == NULL) {
+        fprintf(stderr, "Memory allocation failed for interned text\n");
+        exit(1);
+    }
+    interned_count++;
+    return interned[slot];
+}
+
+uint64_t hash_key(Key key) {
+    if (key.is_text) {
+        return hash_bits((uint64_t) (uintptr_t) key.text);
+    }
+    uint64_t bits;
+    memcpy(&bits, &key.number, sizeof(bits));
+    return hash_bits(bits);
+}
+
+// Keys compare by bits, so that every NaN is one group, and 0 and -0 are made the same number when read
+bool keys_equal(Key a, Key b) {
+    if (a.is_text != b.is_text) {
+        return false;
+    }
+    return a.is_text ? a.text == b.text : memcmp(&a.number, &b.number, sizeof(double)) == 0;
+}
+
+// Drop the groups no source row is in, moving the others down and giving the rows the new indices of their groups
+// An empty group is not part of the output, so it has no output row to keep
+void compact_groups(Pivot *pivot) {
+    if (pivot->num_groups == 0) {
+        return;
+    }
+    int *moved_to = malloc(pivot->num_groups * sizeof(int));
+    if (moved_to == NULL) {
+        fprintf(stderr, "Memory allocation failed for pivot\n");
+        exit(1);
+    }
+    int live = 0;
+    for (int g = 0; g < pivot->num_groups; g++) {
+        moved_to[g] = -1;
+        if (pivot->groups[g].rows > 0) {
+            pivot->groups[live] = pivot->groups[g];
+            moved_to[g] = live++;
+        }
+    }
+    int rows = (int) pivot->spec.last - (int) pivot->spec.first + 1;
+    for (int i = 0; i < rows; i++) {
+        if (pivot->row_group[i] >= 0) {
+            pivot->row_group[i] = moved_to[pivot->row_group[i]];
+        }
+    }
+    pivot->num_groups = live;
+    free(moved_to);
+}
+
+// Find the group of a key, adding an empty group if there is none
+// Adding a group may drop the empty groups and move the others, so group indices held by the caller
+// other than those in row_group are no longer valid
+int find_group(Pivot *pivot, Key key) {
+    if ((pivot->num_groups + 1) * 2 > pivot->num_slots) {
+        compact_groups(pivot);
+        // Leave room for at least as many new groups as are kept before this is done again
+        int num_slots = pivot->num_slots == 0 ? 16 : pivot->num_slots;
+        while ((pivot->num_groups + 1) * 4 > num_slots) {
+            num_slots *= 2;
+        }
+        int *grown = malloc(num_slots * sizeof(int));
+        if (grown == NULL) {
+            fprintf(stderr, "Memory allocation failed for pivot\n");
+            exit(1);
+        }
+        memset(grown, -1, num_slots * sizeof(int));
+        for (int g = 0; g < pivot->num_groups; g++) {
+            int slot = (int) (hash_key(pivot->groups[g].key) & (num_slots - 1));
+            while (grown[slot] >= 0) slot = (slot + 1) & (num_slots - 1);
+            grown[slot] = g;
+        }
+        free(pivot->slots);
+        pivot->slots = grown;
+        pivot->num_slots = num_slots;
+    }
+    int slot = (int) (hash_key(key) & (pivot->num_slots - 1));
+    while (pivot->slots[slot] >= 0) {
+        if (keys_equal(pivot->groups[pivot->slots[slot]].key, key)) {
+            return pivot->slots[slot];
+        }
+        slot = (slot + 1) & (pivot->num_slots - 1);
+    }
+
+    if (pivot->num_groups == pivot->groups_capacity) {
+        int capacity = pivot->groups_capacity == 0 ? 8 : pivot->groups_capacity * 2;
+        Group *grown = realloc(pivot->groups, capacity * sizeof(Group));
+        if (grown == NULL) {
+            fprintf(stderr, "Memory allocation failed for pivot\n");
+            exit(1);
+        }
+        pivot->groups = grown;
+        pivot->groups_capacity = capacity;
+    }
+    Group *group = &pivot->groups[pivot->num_groups];
+    memset(group, 0, sizeof(Group));
+    group->key = key;
+    group->output_row = -1;
+    pivot->slots[slot] = pivot->num_groups;
+    return pivot->num_groups++;
+}
+
+// Get the cell shown at a logical row and column of any loaded sheet
+Cell *sheet_cell(Sheet *sheet, int row, int col) {
+    return &sheet->cells[sheet->row_map[row]][sheet->col_map[col]];
+}
+
+// Read the key and value of a source row of a pivot
+// Returns false if the key cell is blank, which leaves the row out of every group
+bool read_pivot_row(Pivot *pivot, int row, Key *key, Value *value, bool *numeric) {
+    Cell *key_cell = sheet_cell(pivot->sheet, row, pivot->spec.key);
+    Cell *value_cell = sheet_cell(pivot->sheet, row, pivot->spec.value);
+    make_resident(pivot->sheet); // Text keys are read from the cells
+    key->is_text = false;
+    key->number = 0.0;
+    key->text = NULL;
+    if (key_cell->type == BLANK) {
+        return false;
+    } else if (key_cell->type == TEXT) {
+        key->is_text = true;
+        key->text = intern(key_cell->content.text);
+    } else if (key_cell->type == FORMULA && key_cell->value.error != ERROR_NONE) {
+        char error_str[16];
+        format_value(key_cell->value, error_str, sizeof(error_str)); // Rows with the same error share a group
+        key->is_text = true;
+        key->text = intern(error_str);
+    } else {
+        key->number = key_cell->type == NUMBER ? key_cell->content.number : key_cell->value.number;
+        if (key->number == 0.0) {
+            key->number = 0.0; // Turn -0 into 0
+        }
+    }
+
+    *value = referenced_value(value_cell);
+    *numeric = value_cell->type == NUMBER || (value_cell->type == FORMULA && value->error == ERROR_NONE);
+    if (value_cell->type == TEXT) {
+        value->error = ERROR_NONE; // Text is not aggregated, unlike in formulas where it is an error
+    }
+    return true;
+}
+
+// Add the value of a row to a group
+void add_to_group(Group *group, Value value, bool numeric) {
+    group->rows++;
+    if (value.error != ERROR_NONE) {
+        group->errors++;
+        group->error = value.error;
+    } else if (numeric) {
+        if (group->numbers == 0 || value.number < group->min) {
+            group->min = value.number;
+        }
+        if (group->numbers == 0 || value.number > group->max) {
+            group->max = value.number;
+        }
+        group->numbers++;
+        group->sum += value.number;
+    }
+}
+
+// Recompute a group from the rows in it, after a row has left it
+// Subtracting the row instead would let the sum drift and cannot undo a minimum or maximum
+void recompute_group(Pivot *pivot, int g) {
+    Group *group = &pivot->groups[g];
+    group->sum = 0.0;
+    group->rows = 0;
+    group->numbers = 0;
+    group->errors = 0;
+    int rows = (int) pivot->spec.last - (int) pivot->spec.first + 1;
+    for (int i = 0; i < rows; i++) {
+        if (pivot->row_group[i] == g) {
+            add_to_group(group, pivot->row_value[i], pivot->row_numeric[i]);
+        }
+    }
+}
+
+// Format the result of a group as the text of its output cell, or "" to leave the cell blank
+void format_group_result(Pivot *pivot, Group *group, char *buffer, size_t size) {
+    if (group->errors > 0) {
+        format_value((Value) {0.0, group->error}, buffer, size);
+        return;
+    }
+    double result;
+    switch (pivot->spec.function) {
+        case PIVOT_COUNT:
+            result = group->rows;
+            break;
+        case PIVOT_AVERAGE:
+            result = group->sum / group->numbers;
+            break;
+        case PIVOT_MIN:
+            result = group->min;
+            break;
+        case PIVOT_MAX:
+            result = group->max;
+            break;
+        default:
+            result = group->sum;
+            break;
+    }
+    if (pivot->spec.function != PIVOT_COUNT && pivot->spec.function != PIVOT_SUM && group->numbers == 0) {
+        buffer[0] = '\0'; // No numbers to average or take the minimum or maximum of
+        return;
+    }
+    snprintf(buffer, size, "%.17g", result);
+}
+
+// Set an output cell of a pivot, skipping cells that already hold the text
+// Only cells the pivot owns are passed here: blank cells it claimed for its output, never cells the user filled
+void write_pivot_cell(Cell *cell, const char *text) {
+    make_resident(cell->sheet); // The output may be on a sheet that was spilled
+    if (text[0] == '\0') {
+        if (cell->type != BLANK) {
+            reset_cell(cell);
+            display_cell(cell);
+            Cell *recalculation[MAX_RECALCULATION_DEPTH];
+            update_dependents(cell, recalculation, 0);
+            notify_pivots(cell);
+        }
+        return;
+    }
+    char buffer[64];
+    if (cell->type == NUMBER) {
+        snprintf(buffer, sizeof(buffer), "%.17g", cell->content.number);
+        if (strcmp(buffer, text) == 0) {
+            return;
+        }
+    } else if (cell->type == TEXT) {
+        if (strcmp(cell->content.text, text) == 0) {
+            return;
+        }
+    }
+    assign_cell(cell, (char *) text);
+}
+
+// Get the cell at a logical row and column of a pivot output if the pivot may write to it: a cell of its current
+// output, or a blank cell. A cell the user filled is left alone and NULL is returned
+Cell *claim_output_cell(Pivot *pivot, int row, int col) {
+    Cell *cell = sheet_cell(pivot->sheet, row, col);
+    for (int k = 0; k < pivot->output_rows; k++) {
+        if (pivot->output[k][0] == cell || pivot->output[k][1] == cell) {
+            return cell;
+        }
+    }
+    return cell->type == BLANK ? cell : NULL;
+}
+
+// Pivot whose groups are being sorted by compare_groups
+Pivot *sort_pivot;
+
+// Compare two groups by key: numbers in ascending order, then text in alphabetical order
+int compare_groups(const void *a, const void *b) {
+    Key *key_a = &sort_pivot->groups[*(const int *) a].key;
+    Key *key_b = &sort_pivot->groups[*(const int *) b].key;
+    if (key_a->is_text != key_b->is_text) {
+        return key_a->is_text - key_b->is_text;
+    }
+    if (key_a->is_text) {
+        return strcmp(key_a->text, key_b->text);
+    }
+    return (key_a->number > key_b->number) - (key_a->number < key_b->number);
+}
+
+// Lay out the whole output of a pivot: one row per non-empty group, sorted by key, with the key and the result
+// Rows left over from a longer output are cleared
+void write_pivot_output(Pivot *pivot) {
+    int order[NUM_ROWS]; // A group holds at least one source row, so there are at most NUM_ROWS of them
+    int count = 0;
+    for (int g = 0; g < pivot->num_groups; g++) {
+        pivot->groups[g].output_row = -1;
+        if (pivot->groups[g].rows > 0) {
+            order[count++] = g;
+        }
+    }
+    sort_pivot = pivot;
+    qsort(order, count, sizeof(int), compare_groups);
+    int available = NUM_ROWS - pivot->spec.target_row;
+    if (count > available) {
+        diagnostic("Error: Pivot at %c%d has %d groups but room for %d", 'A' + pivot->spec.target_col,
+                   pivot->spec.target_row + 1, count, available);
+        count = available;
+    }
+
+    pivot->updating = true;
+    Cell *output[NUM_ROWS][2];
+    int blocked = 0;
+    for (int k = 0; k < count; k++) {
+        for (int j = 0; j < 2; j++) {
+            output[k][j] = claim_output_cell(pivot, pivot->spec.target_row + k, pivot->spec.target_col + j);
+            blocked += output[k][j] == NULL;
+        }
+    }
+    if (blocked > 0) {
+        diagnostic("Error: Pivot at %c%d would write over %d cells", 'A' + pivot->spec.target_col,
+                   pivot->spec.target_row + 1, blocked);
+    }
+    // Clear the cells of the previous output that are not part of this one
+    for (int k = 0; k < pivot->output_rows; k++) {
+        for (int j = 0; j < 2; j++) {
+            if (pivot->output[k][j] == NULL) {
+                continue;
+            }
+            bool kept = false;
+            for (int m = 0; m < count && !kept; m++) {
+                kept = output[m][0] == pivot->output[k][j] || output[m][1] == pivot->output[k][j];
+            }
+            if (!kept) {
+                write_pivot_cell(pivot->output[k][j], "");
+            }
+        }
+    }
+    for (int k = 0; k < count; k++) {
+        Group *group = &pivot->groups[order[k]];
+        char text[64];
+        if (output[k][0] != NULL) {
+            if (group->key.is_text) {
+                write_pivot_cell(output[k][0], group->key.text);
+            } else {
+                snprintf(text, sizeof(text), "%.17g", group->key.number);
+                write_pivot_cell(output[k][0], text);
+            }
+        }
+        if (output[k][1] != NULL) {
+            format_group_result(pivot, group, text, sizeof(text));
+            write_pivot_cell(output[k][1], text);
+        }
+        group->output_row = k;
+    }
+    memcpy(pivot->output, output, sizeof(output));
+    pivot->output_rows = count;
+    pivot->updating = false;
+}
+
+// Rewrite the result cell of a single group
+void write_group_result(Pivot *pivot, int g) {
+    if (g < 0 || pivot->groups[g].output_row < 0) {
+        return;
+    }
+    int k = pivot->groups[g].output_row;
+    Cell **cell = &pivot->output[k][1];
+    if (*cell == NULL) {
+        // The user took the cell; it is claimed again once it is blank
+        *cell = claim_output_cell(pivot, pivot->spec.target_row + k, pivot->spec.target_col + 1);
+        if (*cell == NULL) {
+            return;
+        }
+    }
+    char text[64];
+    format_group_result(pivot, &pivot->groups[g], text, sizeof(text));
+    pivot->updating = true;
+    write_pivot_cell(*cell, text);
+    pivot->updating = false;
+}
+
+// Aggregate the whole source range of a pivot again and lay out its output
+void rebuild_pivot(Pivot *pivot) {
+    pivot->num_groups = 0;
+    if (pivot->slots != NULL) {
+        memset(pivot->slots, -1, pivot->num_slots * sizeof(int));
+    }
+    memset(pivot->row_group, -1, sizeof(pivot->row_group)); // Rows not read yet are in no group
+    for (int row = pivot->spec.first; row <= (int) pivot->spec.last; row++) {
+        int i = row - pivot->spec.first;
+        Key key;
+        if (read_pivot_row(pivot, row, &key, &pivot->row_value[i], &pivot->row_numeric[i])) {
+            pivot->row_group[i] = find_group(pivot, key);
+            add_to_group(&pivot->groups[pivot->row_group[i]], pivot->row_value[i], pivot->row_numeric[i]);
+        }
+    }
+    write_pivot_output(pivot);
+}
+
+void rebuild_pivots(Sheet *sheet) {
+    for (int i = 0; i < num_pivots; i++) {
+        if (pivots[i]->sheet == sheet) {
+            rebuild_pivot(pivots[i]);
+        }
+    }
+}
+
+// Move a source row of a pivot from the group it was in to the group of its current key
+void update_pivot_row(Pivot *pivot, int row) {
+    int i = row - pivot->spec.first;
+    Key key;
+    int new_group = -1;
+    if (read_pivot_row(pivot, row, &key, &pivot->row_value[i], &pivot->row_numeric[i])) {
+        new_group = find_group(pivot, key);
+    }
+    int old_group = pivot->row_group[i]; // Read after find_group, which may move it
+    pivot->row_group[i] = new_group;
+
+    if (old_group >= 0) {
+        recompute_group(pivot, old_group);
+    }
+    if (new_group >= 0 && new_group != old_group) {
+        add_to_group(&pivot->groups[new_group], pivot->row_value[i], pivot->row_numeric[i]);
+    }
+
+    // A group appearing or becoming empty changes which rows the output has
+    if ((old_group >= 0 && pivot->groups[old_group].rows == 0) ||
+        (new_group >= 0 && new_group != old_group && pivot->groups[new_group].rows == 1)) {
+        write_pivot_output(pivot);
+        return;
+    }
+    write_group_result(pivot, old_group);
+    if (new_group != old_group) {
+        write_group_result(pivot, new_group);
+    }
+}
+
+void release_pivot_output(Cell *cell) {
+    for (int i = 0; i < num_pivots; i++) {
+        for (int k = 0; k < pivots[i]->output_rows; k++) {
+            for (int j = 0; j < 2; j++) {
+                if (pivots[i]->output[k][j] == cell) {
+                    pivots[i]->output[k][j] = NULL;
+                }
+            }
+        }
+    }
+}
+
+bool is_pivot_output(int sheet, ROW row, COL col) {
+    if (sheet < 0 || sheet >= num_sheets || sheets[sheet] == NULL ||
+        row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
+        return false;
+    }
+    Cell *cell = sheet_cell(sheets[sheet], row, col);
+    for (int i = 0; i < num_pivots; i++) {
+        for (int k = 0; k < pivots[i]->output_rows; k++) {
+            if (pivots[i]->output[k][0] == cell || pivots[i]->output[k][1] == cell) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void notify_pivots(Cell *cell) {
+    if (num_pivots == 0) {
+        return;
+    }
+    Sheet *sheet = cell->sheet;
+    int physical_row, physical_col;
+    physical_position(cell, &physical_row, &physical_col);
+    int row = sheet->row_position[physical_row];
+    int col = sheet->col_position[physical_col];
+    for (int i = 0; i < num_pivots; i++) {
+        Pivot *pivot = pivots[i];
+        if (pivot->sheet == sheet && !pivot->updating && row >= (int) pivot->spec.first && row <= (int) pivot->spec.last &&
+            (col == (int) pivot->spec.key || col == (int) pivot->spec.value)) {
+            update_pivot_row(pivot, row);
+        }
+    }
+}
+
+// Find the pivot of a sheet whose output starts at a logical row and column
+int find_pivot(Sheet *sheet, int target_row, int target_col) {
+    for (int i = 0; i < num_pivots; i++) {
+        if (pivots[i]->sheet == sheet && (int) pivots[i]->spec.target_row == target_row &&
+            (int) pivots[i]->spec.target_col == target_col) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Check a pivot before adding it to a sheet
+// Its output, which can reach down to the last row, must not overlap its own source range or another pivot's output
+bool valid_pivot(Sheet *sheet, const PivotSpec *spec) {
+    if ((int) spec->first < 0 || (int) spec->last >= NUM_ROWS || spec->first > spec->last ||
+        (int) spec->key < 0 || (int) spec->key >= NUM_COLS || (int) spec->value < 0 || (int) spec->value >= NUM_COLS ||
+        (int) spec->function < PIVOT_SUM || (int) spec->function > PIVOT_MAX ||
+        (int) spec->target_row < 0 || (int) spec->target_row >= NUM_ROWS ||
+        (int) spec->target_col < 0 || (int) spec->target_col + 1 >= NUM_COLS || num_pivots == MAX_PIVOTS) {
+        return false;
+    }
+    bool rows_overlap = spec->last >= spec->target_row;
+    for (int j = spec->target_col; j <= (int) spec->target_col + 1; j++) {
+        if (rows_overlap && (j == (int) spec->key || j == (int) spec->value)) {
+            return false;
+        }
+    }
+    for (int i = 0; i < num_pivots; i++) {
+        int distance = (int) pivots[i]->spec.target_col - (int) spec->target_col;
+        if (pivots[i]->sheet == sheet && distance >= -1 && distance <= 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Add a pivot to a sheet and write its output
+bool create_pivot(Sheet *sheet, const PivotSpec *spec) {
+    if (!valid_pivot(sheet, spec)) {
+        return false;
+    }
+    Pivot *pivot = calloc(1, sizeof(Pivot));
+    if (pivot == NULL) {
+        fprintf(stderr, "Memory allocation failed for pivot\n");
+        exit(1);
+    }
+    pivot->sheet = sheet;
+    pivot->spec = *spec;
+    pivots[num_pivots++] = pivot;
+    rebuild_pivot(pivot);
+    return true;
+}
+
+// Free every pivot, for model_init
+void free_pivots() {
+    for (int i = 0; i < num_pivots; i++) {
+        free(pivots[i]->groups);
+        free(pivots[i]->slots);
+        free(pivots[i]);
+    }
+    num_pivots = 0;
+}
+
+// Free the pivots of a sheet that is being freed, leaving their output as it is
+void free_sheet_pivots(Sheet *sheet) {
+    for (int i = 0; i < num_pivots;) {
+        if (pivots[i]->sheet == sheet) {
+            free(pivots[i]->groups);
+            free(pivots[i]->slots);
+            free(pivots[i]);
+            pivots[i] = pivots[--num_pivots];
+        } else {
+            i++;
+        }
+    }
+}
+
+// Returns true if every cell the output of a pivot can reach, from its target row down to the last row, is blank
+bool is_blank_target(Sheet *sheet, const PivotSpec *spec) {
+    for (int i = spec->target_row; i < NUM_ROWS; i++) {
+        for (int j = spec->target_col; j <= (int) spec->target_col + 1; j++) {
+            if (sheet_cell(sheet, i, j)->type != BLANK) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A pivot loaded with its sheet skips this check, since cells the user typed over its output are saved with it
+bool add_pivot(const PivotSpec *spec) {
+    if (!valid_pivot(active, spec) || !is_blank_target(active, spec)) {
+        return false;
+    }
+    journal_log_add_pivot(spec);
+    create_pivot(active, spec);
+    commit_snapshot();
+    enforce_memory_budget();
+    return true;
+}
+
+// Remove the pivot whose output starts at a cell of the active sheet, clearing its output
+bool remove_pivot(ROW target_row, COL target_col) {
+    int index = find_pivot(active, target_row, target_col);
+    if (index < 0) {
+        return false;
+    }
+    journal_log_remove_pivot(target_row, target_col);
+    Pivot *pivot = pivots[index];
+    for (int k = 0; k < pivot->output_rows; k++) {
+        for (int j = 0; j < 2; j++) {
+            if (pivot->output[k][j] != NULL) {
+                write_pivot_cell(pivot->output[k][j], "");
+            }
+        }
+    }
+    free(pivot->groups);
+    free(pivot->slots);
+    free(pivot);
+    pivots[index] = pivots[--num_pivots];
+    commit_snapshot();
+    enforce_memory_budget();
+    return true;
+}
+
+int get_sheet_pivots(int sheet, PivotSpec *specs, int capacity) {
+    int count = 0;
+    for (int i = 0; i < num_pivots && count < capacity; i++) {
+        if (pivots[i]->sheet->index == sheet) {
+            specs[count++] = pivots[i]->spec;
+        }
+    }
+    return count;
+}
+
+bool load_sheet_pivot(int sheet, const PivotSpec *spec) {
+    if (sheet < 0 || sheet >= num_sheets || sheets[sheet] == NULL) {
+        return false;
+    }
+    return create_pivot(sheets[sheet], spec);
+}
+
+// Scenarios: what-if variants of a sheet (see fork_scenario)
+// A scenario shares every cell, value and compiled formula of the workbook and only owns an overlay: the values of
+// its inputs and of the formulas downstream of them. Cells missing from the overlay read through to the workbook,
+// so forking costs nothing and evaluating only walks the subgraph reachable from the inputs through the dependents.
+// The overlay is an open addressing hash table from cell_index to value, like the groups of a pivot
+
+// Defines a struct called OverlayEntry, which is the value a cell has in a scenario
+typedef struct OverlayEntry {
+    int index; // cell_index of the cell
+    Value value;
+} OverlayEntry;
+
+// One step of evaluating a scenario: a formula cell downstream of the inputs, in an order where it comes after the
+// cells it references
+typedef struct ScenarioStep {
+    Cell *cell;
+    bool circular; // Closes a circular reference, so it evaluates to #CIRC!
+} ScenarioStep;
+
+typedef struct Scenario {
+    Sheet *sheet; // Sheet the scenario was forked from, holding its inputs
+    Cell **inputs; // Cells given another value; like formula references, they follow their cell when rows move
+    Value *input_values;
+    int num_inputs;
+    int inputs_capacity;
+    OverlayEntry *entries;
+    int num_entries;
+    int entries_capacity;
+    int *slots; // Hash table of entry indices, -1 for an empty slot; its size is a power of two
+    int num_slots;
+    ScenarioStep *steps;
+    int num_steps;
+    int steps_capacity;
+    unsigned long evaluated_version; // model_version the overlay was computed from, or 0 if it must be recomputed
+} Scenario;
+
+Scenario *scenarios[MAX_SCENARIOS]; // Indexed by scenario number, NULL for a free number
+
+// Marks of the cells while the steps of a scenario are ordered: 1 while its dependents are being visited, 3 if it is
+// also found to be circular, 2 once done
+char scenario_marks[MAX_SHEETS * SHEET_CELLS];
+
+// Grow an array of 'size'-byte elements to hold at least 'needed' of them
+void *grow_array(void *array, int *capacity, int needed, size_t size) {
+    if (needed <= *capacity) {
+        return array;
+    }
+    int grown_capacity = *capacity == 0 ? 8 : *capacity;
+    while (grown_capacity < needed) {
+        grown_capacity *= 2;
+    }
+    void *grown = realloc(array, grown_capacity * size);
+    if (grown == NULL) {
+        fprintf(stderr, "Memory allocation failed for scenario\n");
+        exit(1);
+    }
+    *capacity = grown_capacity;
+    return grown;
+}
+
+// Empty the overlay of a scenario, making room for 'count' values so that setting them allocates nothing
+void reset_overlay(Scenario *scenario, int count) {
+    scenario->entries = grow_array(scenario->entries, &scenario->entries_capacity, count, sizeof(OverlayEntry));
+    scenario->num_entries = 0;
+    if (count * 2 > scenario->num_slots) {
+        int num_slots = 16;
+        while (count * 2 > num_slots) {
+            num_slots *= 2;
+        }
+        free(scenario->slots);
+        scenario->slots = malloc(num_slots * sizeof(int));
+        if (scenario->slots == NULL) {
+            fprintf(stderr, "Memory allocation failed for scenario\n");
+            exit(1);
+        }
+        scenario->num_slots = num_slots;
+    }
+    memset(scenario->slots, -1, scenario->num_slots * sizeof(int));
+}
+
+// Find the slot of a cell in the overlay: the one holding it, or the empty slot where it belongs
+int overlay_slot(Scenario *scenario, int index) {
+    int slot = (int) (hash_bits((uint64_t) index) & (scenario->num_slots - 1));
+    while (scenario->slots[slot] >= 0 && scenario->entries[scenario->slots[slot]].index != index) {
+        slot = (slot + 1) & (scenario->num_slots - 1);
+    }
+    return slot;
+}
+
+// Set the value of a cell in the overlay; reset_overlay must have made room for it
+void set_overlay(Scenario *scenario, Cell *cell, Value value) {
+    int index = cell_index(cell);
+    int slot = overlay_slot(scenario, index);
+    if (scenario->slots[slot] < 0) {
+        scenario->slots[slot] = scenario->num_entries;
+        scenario->entries[scenario->num_entries++].index = index;
+    }
+    scenario->entries[scenario->slots[slot]].value = value;
+}
+
+// Get the value of a referenced cell in a scenario: from the overlay, or else from the workbook
+Value scenario_value(Scenario *scenario, Cell *cell) {
+    int slot = overlay_slot(scenario, cell_index(cell));
+    if (scenario->slots[slot] >= 0) {
+        return scenario->entries[scenario->slots[slot]].value;
+    }
+    return referenced_value(cell);
+}
+
+// Evaluate a formula cell in a scenario; this is evaluate_cell reading its references through the overlay
+// It does not modify the workbook, so scenarios can be evaluated on several threads at once
+Value evaluate_in_scenario(Scenario *scenario, Cell *cell) {
+    Compiled *compiled = &cell->compiled;
+    Value result = {compiled->constant, ERROR_NONE};
+    Value first, second;
+    if (!specialization_enabled) {
+        result.number = 0.0;
+        for (Node *node = cell->content.formula; node != NULL; node = node->next) {
+            if (node->type == CONSTANT) {
+                result.number += node->content.constant;
+                continue;
+            }
+            Cell *referenced = referenced_cell(node);
+            if (referenced == NULL) {
+                result.error = ERROR_REF;
+                return result;
+            }
+            Value value = scenario_value(scenario, referenced);
+            if (value.error != ERROR_NONE) {
+                return value;
+            }
+            result.number += value.number;
+        }
+        return result;
+    }
+    switch (compiled->shape) {
+        case CONSTANT_ONLY:
+            return result;
+        case ALIAS:
+            return scenario_value(scenario, compiled->first);
+        case REFERENCE_PLUS_CONSTANT:
+            first = scenario_value(scenario, compiled->first);
+            first.number += compiled->constant;
+            return first;
+        case TWO_REFERENCES:
+            first = scenario_value(scenario, compiled->first);
+            if (first.error != ERROR_NONE) {
+                return first;
+            }
+            second = scenario_value(scenario, compiled->second);
+            if (second.error != ERROR_NONE) {
+                return second;
+            }
+            result.number = first.number + second.number + compiled->constant;
+            return result;
+        case INVALID_REFERENCE:
+            result.error = ERROR_REF;
+            return result;
+        default:
+            for (Node *node = cell->content.formula; node != NULL; node = node->next) {
+                if (node->type == REFERENCE) {
+                    if (referenced_cell(node) == NULL) {
+                        result.error = ERROR_REF;
+                        return result;
+                    }
+                    Value referenced = scenario_value(scenario, referenced_cell(node));
+                    if (referenced.error != ERROR_NONE) {
+                        return referenced;
+                    }
+                    result.number += referenced.number;
+                }
+            }
+            return result;
+    }
+}
+
+// Returns true if a cell is one of the inputs of a scenario
+bool is_scenario_input(Scenario *scenario, Cell *cell) {
+    for (int i = 0; i < scenario->num_inputs; i++) {
+        if (scenario->inputs[i] == cell) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Add the formula dependents of a cell, and theirs, to the steps of a scenario
+// Cells are added after all of their dependents, so the steps are run backwards
+void add_scenario_steps(Scenario *scenario, Cell *cell) {
+    int index = cell_index(cell);
+    scenario_marks[index] = 1;
+    for (int i = 0; i < cell->num_dependents; i++) {
+        Cell *dependent = cell->dependents[i];
+        int dependent_index = cell_index(dependent);
+        if (dependent->type != FORMULA || is_scenario_input(scenario, dependent)) {
+            continue; // Inputs keep the value the scenario gives them
+        }
+        if (scenario_marks[dependent_index] == 0) {
+            add_scenario_steps(scenario, dependent);
+        } else if (scenario_marks[dependent_index] == 1) {
+            // The dependent is still being visited, so this closes a circular reference; flag it when it is added
+            scenario_marks[dependent_index] = 3;
+        }
+    }
+    scenario->steps = grow_array(scenario->steps, &scenario->steps_capacity, scenario->num_steps + 1,
+                                 sizeof(ScenarioStep));
+    scenario->steps[scenario->num_steps].cell = cell;
+    scenario->steps[scenario->num_steps].circular = scenario_marks[index] == 3;
+    scenario->num_steps++;
+    scenario_marks[index] = 2;
+}
+
+// Find the cells a scenario has to recalculate and make room for their values
+// This is the part of evaluating a scenario that may modify the workbook (reading spilled formulas back), so it is
+// done on the calling thread before run_scenario
+void plan_scenario(Scenario *scenario) {
+    scenario->num_steps = 0;
+    for (int i = 0; i < scenario->num_inputs; i++) {
+        if (scenario_marks[cell_index(scenario->inputs[i])] == 0) {
+            add_scenario_steps(scenario, scenario->inputs[i]);
+        }
+    }
+    // Every marked cell is a step (the inputs too), so this clears the marks for the next scenario
+    for (int i = 0; i < scenario->num_steps; i++) {
+        Cell *cell = scenario->steps[i].cell;
+        scenario_marks[cell_index(cell)] = 0;
+        if (cell->type == FORMULA && (!specialization_enabled || cell->compiled.shape == GENERIC)) {
+            make_resident(cell->sheet); // The generic evaluator walks the nodes of the formula
+        }
+    }
+    reset_overlay(scenario, scenario->num_inputs + scenario->num_steps);
+}
+
+// Compute the overlay of a scenario planned by plan_scenario
+void run_scenario(Scenario *scenario) {
+    for (int i = 0; i < scenario->num_inputs; i++) {
+        set_overlay(scenario, scenario->inputs[i], scenario->input_values[i]);
+    }
+    for (int i = scenario->num_steps - 1; i >= 0; i--) {
+        Cell *cell = scenario->steps[i].cell;
+        if (cell->type != FORMULA || is_scenario_input(scenario, cell)) {
+            continue;
+        }
+        Value value = {0.0, ERROR_CIRC};
+        if (!scenario->steps[i].circular) {
+            value = evaluate_in_scenario(scenario, cell);
+        }
+        set_overlay(scenario, cell, value);
+    }
+    scenario->evaluated_version = model_version;
+}
+
+// Scenarios being evaluated by evaluate_scenarios, and the next one for a thread to take
+Scenario *evaluating[MAX_SCENARIOS];
+int num_evaluating = 0;
+atomic_int next_evaluating;
+
+// Evaluate scenarios until none are left
+void *scenario_worker(void *unused) {
+    (void) unused;
+    for (int i = atomic_fetch_add(&next_evaluating, 1); i < num_evaluating; i = atomic_fetch_add(&next_evaluating, 1)) {
+        run_scenario(evaluating[i]);
+    }
+    return NULL;
+}
+
+void evaluate_scenarios(int threads) {
+    num_evaluating = 0;
+    for (int i = 0; i < MAX_SCENARIOS; i++) {
+        if (scenarios[i] != NULL && scenarios[i]->evaluated_version != model_version) {
+            plan_scenario(scenarios[i]);
+            evaluating[num_evaluating++] = scenarios[i];
+        }
+    }
+    atomic_store(&next_evaluating, 0);
+
+    // The calling thread evaluates scenarios too, and takes over those of any thread that could not be started
+    pthread_t workers[MAX_SCENARIOS];
+    int num_workers = 0;
+    while (num_workers < threads - 1 && num_workers < num_evaluating - 1 &&
+           pthread_create(&workers[num_workers], NULL, scenario_worker, NULL) == 0) {
+        num_workers++;
+    }
+    scenario_worker(NULL);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    num_evaluating = 0;
+}
+
+// Get a scenario from its number, or NULL if there is no such scenario
+Scenario *find_scenario(int scenario) {
+    return scenario >= 0 && scenario < MAX_SCENARIOS ? scenarios[scenario] : NULL;
+}
+
+int fork_scenario(int sheet) {
+    if (sheet < 0 || sheet >= num_sheets) {
+        return -1;
+    }
+    for (int i = 0; i < MAX_SCENARIOS; i++) {
+        if (scenarios[i] == NULL) {
+            scenarios[i] = calloc(1, sizeof(Scenario));
+            if (scenarios[i] == NULL) {
+                fprintf(stderr, "Memory allocation failed for scenario\n");
+                exit(1);
+            }
+            scenarios[i]->sheet = use_sheet(sheet);
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool set_scenario_input(int scenario, ROW row, COL col, double number) {
+    Scenario *forked = find_scenario(scenario);
+    if (forked == NULL || row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
+        return false;
+    }
+    Cell *cell = &forked->sheet->cells[forked->sheet->row_map[row]][forked->sheet->col_map[col]];
+    int i = 0;
+    while (i < forked->num_inputs && forked->inputs[i] != cell) {
+        i++;
+    }
+    if (i == forked->num_inputs) {
+        forked->inputs = grow_array(forked->inputs, &forked->inputs_capacity, i + 1, sizeof(Cell *));
+        forked->input_values = realloc(forked->input_values, forked->inputs_capacity * sizeof(Value));
+        if (forked->input_values == NULL) {
+            fprintf(stderr, "Memory allocation failed for scenario\n");
+            exit(1);
+        }
+        forked->inputs[i] = cell;
+        forked->num_inputs++;
+    }
+    forked->input_values[i] = (Value) {number, ERROR_NONE};
+    forked->evaluated_version = 0;
+    return true;
+}
+
+char *get_scenario_value(int scenario, int sheet, ROW row, COL col) {
+    Scenario *forked = find_scenario(scenario);
+    if (forked == NULL || sheet < 0 || sheet >= num_sheets || row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS) {
+        return NULL;
+    }
+    if (sheets[sheet] == NULL) {
+        use_sheet(sheet);
+        model_version++; // Formulas of the sheet may depend on the inputs
+    }
+    if (forked->evaluated_version != model_version) {
+        plan_scenario(forked);
+        run_scenario(forked);
+    }
+
+    Cell *cell = &sheets[sheet]->cells[sheets[sheet]->row_map[row]][sheets[sheet]->col_map[col]];
+    int slot = overlay_slot(forked, cell_index(cell));
+    char result[64];
+    if (forked->slots[slot] >= 0) {
+        format_value(forked->entries[forked->slots[slot]].value, result, sizeof(result));
+    } else if (cell->type == TEXT) {
+        make_resident(cell->sheet);
+        return strdup(cell->content.text);
+    } else if (cell->type == BLANK) {
+        result[0] = '\0';
+    } else {
+        format_value(referenced_value(cell), result, sizeof(result));
+    }
+    return strdup(result);
+}
+
+void free_scenario(int scenario) {
+    Scenario *forked = find_scenario(scenario);
+    if (forked == NULL) {
+        return;
+    }
+    free(forked->inputs);
+    free(forked->input_values);
+    free(forked->entries);
+    free(forked->slots);
+    free(forked->steps);
+    free(forked);
+    scenarios[scenario] = NULL;
+}
+
+void free_scenarios() {
+    for (int i = 0; i < MAX_SCENARIOS; i++) {
+        free_scenario(i);
+    }
+}
+
+// Free the scenarios forked from a sheet that is being freed, or whose downstream formulas are on it
+void free_sheet_scenarios(Sheet *sheet) {
+    for (int i = 0; i < MAX_SCENARIOS; i++) {
+        Scenario *forked = scenarios[i];
+        bool uses_sheet = forked != NULL && forked->sheet == sheet;
+        for (int k = 0; forked != NULL && k < forked->num_steps && !uses_sheet; k++) {
+            uses_sheet = forked->steps[k].cell->sheet == sheet;
+        }
+        if (uses_sheet) {
+            free_scenario(i);
+        }
+    }
+}
+
+int get_scenario_overlay_size(int scenario) {
+    Scenario *forked = find_scenario(scenario);
+    return forked == NULL ? -1 : forked->num_entries;
+}
+
+// Limit the memory used by text and formulas, spilling cold sheets to a file at 'spill_path'
+bool set_memory_budget(size_t bytes, const char *spill_path) {
+    if (bytes > 0 && !spill_is_open() && (spill_path == NULL || !spill_open(spill_path))) {
+        return false;
+    }
+    memory_budget = bytes;
+    enforce_memory_budget();
+    return true;
+}
+
+MemoryStats get_memory_stats() {
+    SpillCounters counters = spill_counters();
+    MemoryStats stats;
+    stats.budget = memory_budget;
+    stats.resident_bytes = resident_bytes;
+    stats.hits = resident_hits;
+    stats.misses = resident_misses;
+    stats.evictions = evictions;
+    stats.reads = counters.reads;
+    stats.writes = counters.writes;
+    stats.bytes_read = counters.bytes_read;
+    stats.bytes_written = counters.bytes_written;
+    return stats;
+}
 
 // Have a good holiday break!
 // I think the method I picked was too complicated and when the formulas came in i should have switched
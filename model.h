@@ -1,9 +1,12 @@
 #ifndef ASSIGNMENT_MODEL_H
 #define ASSIGNMENT_MODEL_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "defs.h"
 
-// Initializes the data structure.
+// Initializes the data structure: a workbook with a single blank sheet.
 //
 // This is called once, at program start.
 void model_init();
@@ -18,6 +21,52 @@ void set_cell_value(ROW row, COL col, char *text);
 // Clears the value of a cell.
 void clear_cell(ROW row, COL col);
 
+// Inserts a blank row before 'row', shifting the rows below it down.
+//
+// Fails and returns false if the last row is not blank, since it would be
+// pushed off the sheet. References to the blank last row become #REF!.
+bool insert_row(ROW row);
+
+// Deletes a row, shifting the rows below it up. References to the deleted
+// cells become #REF!.
+bool delete_row(ROW row);
+
+// Inserts a blank column before 'col', shifting the columns to its right.
+//
+// Fails and returns false if the last column is not blank. References to the
+// blank last column become #REF!.
+bool insert_col(COL col);
+
+// Deletes a column, shifting the columns to its right left. References to the
+// deleted cells become #REF!.
+bool delete_col(COL col);
+
+// Sorts rows 'first' to 'last' (inclusive) by the values in column 'key'.
+// Numbers sort before text; blank cells always sort last. Formulas keep
+// referring to the same cells, wherever those cells end up.
+bool sort_rows(ROW first, ROW last, COL key, bool ascending);
+
+// Recalculates every formula in the loaded sheets, each one after the formulas
+// it references, and updates the display of the cells whose value changed.
+void recalculate_all();
+
+// Turns the specialized evaluators for common formula shapes (=A1, =A1+B1,
+// =A1+0.5, constants) on or off. They are on by default; turning them off
+// evaluates every formula through the generic interpreter, for benchmarking.
+void set_formula_specialization(bool enabled);
+
+// Limits the cells whose display 'update_cell_display' is called for to the
+// 'rows' by 'cols' cells from 'first_row' and 'first_col' of the active sheet;
+// changes to other cells are not even formatted. By default every cell is
+// displayed. An interface showing only part of the sheet sets this to what it
+// shows and, whenever that changes, fetches the newly shown cells with
+// 'get_display_text'.
+void set_display_window(ROW first_row, COL first_col, int rows, int cols);
+
+// Copies the text a cell of the active sheet displays into 'buffer', which
+// holds 'size' characters including the terminating null.
+void get_display_text(ROW row, COL col, char *buffer, size_t size);
+
 // Gets a textual representation of the value of a cell, for editing.
 //
 // The returned string must have been allocated using 'malloc' and is now owned
@@ -25,4 +74,168 @@ void clear_cell(ROW row, COL col);
 // retain any reference to it after the function returns.
 char *get_textual_value(ROW row, COL col);
 
+// Gets the text which recreates a cell when passed to 'set_cell_value', or NULL
+// for a blank cell. Unlike 'get_textual_value', numbers keep full precision.
+//
+// The returned string must have been allocated using 'malloc' and is now owned
+// by the caller.
+char *get_input_value(ROW row, COL col);
+
+// A workbook holds up to MAX_SHEETS sheets, each NUM_ROWS by NUM_COLS. All of
+// the functions above work on the active sheet, which is the one displayed.
+// Formulas refer to cells of other sheets by name, as in "=Sheet2!A1+B1".
+//
+// Sheets restored from a journal snapshot are only loaded into memory when
+// they are first activated or referenced by a formula.
+#define MAX_SHEETS 64
+#define SHEET_NAME_LENGTH 32
+#define DEFAULT_SHEET_NAME "Sheet1"
+
+// Adds a blank sheet at the end of the workbook. Names are made of letters,
+// digits and underscores. Returns the index of the sheet, or -1 if the name is
+// invalid or taken or the workbook is full.
+int add_sheet(const char *name);
+
+// Returns the index of the sheet with the given name, or -1.
+int find_sheet(const char *name);
+
+int sheet_count();
+
+// Returns the name of a sheet, or NULL if there is no such sheet. The string
+// is owned by the model.
+const char *sheet_name(int sheet);
+
+int active_sheet();
+
+// Makes a sheet the active sheet, loading it if needed, and redisplays every
+// cell.
+bool activate_sheet(int sheet);
+
+// Limits the memory held by the text and formulas of cells to 'bytes'. Once
+// it is exceeded, the least recently used sheets other than the active one
+// have their text and formulas written to a spill file at 'spill_path' and
+// freed; they are read back the next time they are needed. Values stay in
+// memory, so most recalculation does not read anything back.
+//
+// A budget of 0 removes the limit. Returns false if the spill file cannot be
+// created.
+bool set_memory_budget(size_t bytes, const char *spill_path);
+
+// Counters for tuning the memory budget. A hit or miss is counted whenever the
+// text or formulas of a sheet are needed; a miss reads the sheet back from the
+// spill file. Counters are reset by 'model_init'.
+typedef struct {
+    size_t budget;
+    size_t resident_bytes; // Text and formulas in memory
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long reads; // I/O on the spill file
+    unsigned long writes;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+} MemoryStats;
+
+MemoryStats get_memory_stats();
+
+// A pivot keeps a summary of a range of the active sheet up to date: rows
+// 'first' to 'last' are grouped by the value of their 'key' column, and the
+// values of their 'value' column are aggregated per group. The output is two
+// columns starting at 'target_row' and 'target_col': one row per group, sorted
+// by key (numbers first, then text), holding the key and the aggregate.
+//
+// Rows with a blank key are left out. Text and blank values are ignored by
+// every function but PIVOT_COUNT, which counts rows; a group containing an
+// error shows that error. Whenever a cell of the range changes, only the
+// groups it leaves and joins are recomputed.
+//
+// A pivot never writes over a cell the user filled: a cell of its output that
+// the user edits is left to the user until it is cleared again.
+typedef enum {
+    PIVOT_SUM,
+    PIVOT_COUNT,
+    PIVOT_AVERAGE,
+    PIVOT_MIN,
+    PIVOT_MAX,
+} PIVOT_FUNCTION;
+
+typedef struct {
+    ROW first;
+    ROW last;
+    COL key;
+    COL value;
+    PIVOT_FUNCTION function;
+    ROW target_row;
+    COL target_col;
+} PivotSpec;
+
+#define MAX_PIVOTS 64
+
+// Adds a pivot to the active sheet and writes its output. Returns false if the
+// spec is out of range, if the output (which may grow down to the last row)
+// would overlap the range or the output of another pivot or a cell that is not
+// blank, or if there are already MAX_PIVOTS pivots.
+bool add_pivot(const PivotSpec *spec);
+
+// Removes the pivot of the active sheet whose output starts at the given cell
+// and clears its output. Returns false if there is no such pivot.
+bool remove_pivot(ROW target_row, COL target_col);
+
+// A scenario is a what-if variant of a sheet: some of its cells are given
+// other numbers, and the formulas depending on them, on any sheet, are
+// recalculated without touching the workbook. A scenario shares every other
+// cell, value and formula with the workbook and only stores the values that
+// differ, so it costs little memory and only the cells downstream of its
+// inputs are recalculated. Scenarios follow later edits of the workbook. Pivots
+// are not recomputed in scenarios.
+#define MAX_SCENARIOS 64
+
+// Forks a scenario from a sheet. Returns the number of the scenario, or -1 if
+// there is no such sheet or MAX_SCENARIOS scenarios exist.
+int fork_scenario(int sheet);
+
+// Gives a cell of the scenario's sheet a number in the scenario, replacing
+// its text, number or formula.
+bool set_scenario_input(int scenario, ROW row, COL col, double number);
+
+// Recalculates every scenario whose inputs or workbook changed since it was
+// last evaluated, spreading the scenarios over up to 'threads' threads. The
+// calling thread is one of them; 1 evaluates them all on the calling thread.
+void evaluate_scenarios(int threads);
+
+// Gets the text a cell of any sheet displays in a scenario, evaluating the
+// scenario first if needed. Returns NULL if there is no such scenario or cell.
+//
+// The returned string must have been allocated using 'malloc' and is now owned
+// by the caller.
+char *get_scenario_value(int scenario, int sheet, ROW row, COL col);
+
+// Returns the number of cell values stored by a scenario: its inputs and the
+// formulas downstream of them. Returns -1 if there is no such scenario.
+int get_scenario_overlay_size(int scenario);
+
+void free_scenario(int scenario);
+
+// Used by the journal to load sheets lazily.
+//
+// 'add_unloaded_sheet' registers a sheet whose cells are still in the snapshot;
+// 'journal_load_sheet' is called to fill it the first time it is used, and sets
+// its cells with 'load_sheet_cell'. 'get_sheet_input_value' is
+// 'get_input_value' for any loaded sheet. Inserting, deleting or sorting rows
+// or columns first loads the sheets whose formulas refer to the edited sheet,
+// so their references move with the cells they refer to.
+int add_unloaded_sheet(const char *name);
+bool is_sheet_loaded(int sheet);
+void load_sheet_cell(int sheet, ROW row, COL col, char *text);
+char *get_sheet_input_value(int sheet, ROW row, COL col);
+
+// Pivots are saved with their sheet: 'get_sheet_pivots' copies up to
+// 'capacity' specs of a loaded sheet and returns how many it copied, and
+// 'load_sheet_pivot' adds one back without journaling it. The cells of pivot
+// outputs, for which 'is_pivot_output' returns true, are not saved, since the
+// pivot writes them again when it is loaded.
+int get_sheet_pivots(int sheet, PivotSpec *specs, int capacity);
+bool load_sheet_pivot(int sheet, const PivotSpec *spec);
+bool is_pivot_output(int sheet, ROW row, COL col);
+
 #endif //ASSIGNMENT_MODEL_H
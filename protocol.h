@@ -0,0 +1,52 @@
+#ifndef ASSIGNMENT_PROTOCOL_H
+#define ASSIGNMENT_PROTOCOL_H
+
+// Wire protocol spoken by spreadsheetd over a Unix domain socket.
+//
+// Requests and responses are single lines terminated by '\n'. Clients may send
+// any number of requests without waiting; every request gets exactly one
+// response line, in order. Cells are written as a column letter followed by a
+// 1-based row number, e.g. "C2". Cells are always those of the active sheet,
+// which is shared by all clients.
+//
+//   SET <cell> <text>    Sets a cell as if typed in; empty text clears it.
+//                        -> OK
+//   BATCH <n>            The next n lines are "<cell> <text>" edits.
+//                        -> OK <n> (after the last edit)
+//   GET <cell>           -> VAL <cell> <displayed text>
+//   RANGE <cell> <cell>  -> VALS <cell>:<cell> <text>\t<text>... (row-major)
+//   DIAG                 Returns and clears the model's buffered diagnostics.
+//                        -> DIAG <dropped count> <message>\t<message>...
+//   SHEET <name>         Makes the named sheet, added if missing, the sheet
+//                        that all clients read and edit. Subscribers are sent
+//                        "SHEET <name>", then CHG for the cells whose displayed
+//                        text differs from the previous sheet's.
+//                        -> OK
+//   PIVOT <function> <cell> <cell> <column> <target>
+//                        Adds a pivot to the active sheet grouping the rows of
+//                        the key column range by key, and aggregating the value
+//                        column with SUM, COUNT, AVERAGE, MIN or MAX. The groups
+//                        are written from the target cell down, as key and
+//                        result, and kept up to date, e.g. "PIVOT SUM A1 A9 B D1".
+//                        -> OK
+//   UNPIVOT <target>     Removes the pivot written at the target cell.
+//                        -> OK
+//   STATS                -> STATS <budget> <resident bytes> <hits> <misses>
+//                           <evictions> <reads> <writes> <bytes read>
+//                           <bytes written>, the memory budget counters.
+//   SUB                  Subscribes to changes.
+//                        -> OK and "SHEET <active sheet>", then
+//                           "CHG <cell> <displayed text>" lines are pushed
+//                           whenever a cell's displayed text changes, and
+//                           "SHEET <name>" lines whenever another sheet becomes
+//                           active. CHG lines are about the sheet named by the
+//                           last SHEET line.
+//
+// Malformed requests are answered with "ERR <reason>".
+
+#define DEFAULT_SOCKET_PATH "/tmp/spreadsheetd.sock"
+
+// Longest request line accepted by the server, including the newline.
+#define MAX_LINE_LENGTH 4096
+
+#endif //ASSIGNMENT_PROTOCOL_H
@@ -0,0 +1,543 @@
+#define _GNU_SOURCE // For accept4.
+
+#include "diagnostics.h"
+#include "interface.h"
+#include "journal.h"
+#include "model.h"
+#include "protocol.h"
+#include "spill.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 64
+#define DISPLAY_TEXT_SIZE 256
+
+// Output a client may have queued before it is considered stuck and dropped.
+#define MAX_PENDING_OUTPUT (16 * 1024 * 1024)
+
+typedef struct {
+    int fd;
+    char *in;
+    size_t in_length;
+    size_t in_capacity;
+    char *out;
+    size_t out_length;
+    size_t out_capacity;
+    uint32_t registered_events; // Events currently requested from epoll.
+    bool subscribed;
+    bool closing; // Peer finished sending; close once output is flushed.
+    int batch_remaining; // Edit lines still expected for the current BATCH.
+    int batch_size;
+    int batch_errors;
+} Client;
+
+static int epoll_fd = -1;
+static Client **clients = NULL;
+static size_t num_clients = 0;
+static size_t clients_capacity = 0;
+
+// Last displayed text of every cell, as reported by the model.
+static char display[NUM_ROWS][NUM_COLS][DISPLAY_TEXT_SIZE];
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int signal) {
+    (void) signal;
+    running = 0;
+}
+
+static bool reserve(char **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity)
+        return true;
+    size_t new_capacity = *capacity < 256 ? 256 : *capacity;
+    while (new_capacity < needed)
+        new_capacity *= 2;
+    char *grown = realloc(*buffer, new_capacity);
+    if (grown == NULL)
+        return false;
+    *buffer = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+static void append(Client *client, const char *text, size_t length) {
+    if (client->out_length + length > MAX_PENDING_OUTPUT ||
+        !reserve(&client->out, &client->out_capacity, client->out_length + length)) {
+        // Drop clients that stop reading rather than buffering without bound.
+        client->closing = true;
+        client->out_length = 0;
+        return;
+    }
+    memcpy(client->out + client->out_length, text, length);
+    client->out_length += length;
+}
+
+static void append_string(Client *client, const char *text) {
+    append(client, text, strlen(text));
+}
+
+static void append_cell_name(Client *client, ROW row, COL col) {
+    char name[16];
+    snprintf(name, sizeof(name), "%c%d", 'A' + col, row + 1);
+    append_string(client, name);
+}
+
+// Parses a cell name such as "C2", skipping leading spaces.
+static bool parse_cell(const char **ptr, ROW *row, COL *col) {
+    const char *p = *ptr;
+    while (*p == ' ')
+        p++;
+    if (!isalpha((unsigned char) *p) || !isdigit((unsigned char) p[1]))
+        return false;
+    int c = toupper((unsigned char) *p) - 'A';
+    char *end;
+    long r = strtol(p + 1, &end, 10) - 1;
+    if (c < 0 || c >= NUM_COLS || r < 0 || r >= NUM_ROWS)
+        return false;
+    *row = (ROW) r;
+    *col = (COL) c;
+    *ptr = end;
+    return true;
+}
+
+// Tells subscribers that the cells of another sheet are shown from now on.
+static void push_sheet(const char *name) {
+    for (size_t i = 0; i < num_clients; i++) {
+        Client *client = clients[i];
+        if (!client->subscribed || client->closing)
+            continue;
+        append_string(client, "SHEET ");
+        append_string(client, name);
+        append_string(client, "\n");
+    }
+}
+
+// Applies "<cell> <text>"; empty text clears the cell.
+static bool apply_edit(const char *args) {
+    ROW row;
+    COL col;
+    if (!parse_cell(&args, &row, &col) || (*args != ' ' && *args != 0))
+        return false;
+    if (*args == ' ')
+        args++;
+    if (*args == 0) {
+        clear_cell(row, col); // Displays the cleared cell itself
+        return true;
+    }
+    char *text = strdup(args);
+    if (text == NULL)
+        return false;
+    set_cell_value(row, col, text);
+    return true;
+}
+
+// Parses "<function> <cell> <cell> <column> <cell>": the key column from the
+// first to the last row of the range, the value column and the target.
+static bool parse_pivot(const char *args, PivotSpec *spec) {
+    static const char *functions[] = {"SUM", "COUNT", "AVERAGE", "MIN", "MAX"};
+    size_t length = strcspn(args, " ");
+    int function = -1;
+    for (int i = 0; i < 5; i++) {
+        if (strlen(functions[i]) == length && strncmp(args, functions[i], length) == 0)
+            function = i;
+    }
+    args += length;
+    COL last_key;
+    if (function < 0 || !parse_cell(&args, &spec->first, &spec->key) ||
+        !parse_cell(&args, &spec->last, &last_key) || last_key != spec->key || *args++ != ' ' ||
+        !isalpha((unsigned char) *args) || toupper((unsigned char) *args) - 'A' >= NUM_COLS)
+        return false;
+    spec->value = (COL) (toupper((unsigned char) *args++) - 'A');
+    spec->function = (PIVOT_FUNCTION) function;
+    return parse_cell(&args, &spec->target_row, &spec->target_col) && *args == 0;
+}
+
+static void handle_line(Client *client, const char *line) {
+    if (client->batch_remaining > 0) {
+        if (!apply_edit(line))
+            client->batch_errors++;
+        if (--client->batch_remaining == 0) {
+            char reply[64];
+            if (client->batch_errors > 0)
+                snprintf(reply, sizeof(reply), "ERR %d bad edits in batch\n", client->batch_errors);
+            else
+                snprintf(reply, sizeof(reply), "OK %d\n", client->batch_size);
+            append_string(client, reply);
+        }
+        return;
+    }
+
+    if (strncmp(line, "SET ", 4) == 0) {
+        append_string(client, apply_edit(line + 4) ? "OK\n" : "ERR bad cell\n");
+    } else if (strncmp(line, "BATCH ", 6) == 0) {
+        int size = atoi(line + 6);
+        if (size <= 0) {
+            append_string(client, size == 0 ? "OK 0\n" : "ERR bad batch size\n");
+            return;
+        }
+        client->batch_remaining = size;
+        client->batch_size = size;
+        client->batch_errors = 0;
+    } else if (strncmp(line, "GET ", 4) == 0) {
+        const char *args = line + 4;
+        ROW row;
+        COL col;
+        if (!parse_cell(&args, &row, &col)) {
+            append_string(client, "ERR bad cell\n");
+            return;
+        }
+        append_string(client, "VAL ");
+        append_cell_name(client, row, col);
+        append_string(client, " ");
+        append_string(client, display[row][col]);
+        append_string(client, "\n");
+    } else if (strncmp(line, "RANGE ", 6) == 0) {
+        const char *args = line + 6;
+        ROW first_row, last_row;
+        COL first_col, last_col;
+        if (!parse_cell(&args, &first_row, &first_col) || !parse_cell(&args, &last_row, &last_col) ||
+            first_row > last_row || first_col > last_col) {
+            append_string(client, "ERR bad range\n");
+            return;
+        }
+        append_string(client, "VALS ");
+        append_cell_name(client, first_row, first_col);
+        append_string(client, ":");
+        append_cell_name(client, last_row, last_col);
+        append_string(client, " ");
+        for (ROW row = first_row; row <= last_row; row++) {
+            for (COL col = first_col; col <= last_col; col++) {
+                if (row != first_row || col != first_col)
+                    append_string(client, "\t");
+                append_string(client, display[row][col]);
+            }
+        }
+        append_string(client, "\n");
+    } else if (strcmp(line, "DIAG") == 0) {
+        char header[32];
+        snprintf(header, sizeof(header), "DIAG %lu ", diagnostics_dropped());
+        append_string(client, header);
+        for (int i = 0; i < diagnostics_count(); i++) {
+            if (i > 0)
+                append_string(client, "\t");
+            append_string(client, diagnostics_get(i));
+        }
+        append_string(client, "\n");
+        diagnostics_clear();
+    } else if (strncmp(line, "SHEET ", 6) == 0) {
+        const char *name = line + 6;
+        int sheet = find_sheet(name);
+        if (sheet < 0)
+            sheet = add_sheet(name);
+        if (sheet >= 0 && sheet != active_sheet())
+            push_sheet(sheet_name(sheet)); // Before the CHG lines of its cells
+        append_string(client, sheet >= 0 && activate_sheet(sheet) ? "OK\n" : "ERR bad sheet\n");
+    } else if (strncmp(line, "PIVOT ", 6) == 0) {
+        PivotSpec spec;
+        append_string(client, parse_pivot(line + 6, &spec) && add_pivot(&spec) ? "OK\n" : "ERR bad pivot\n");
+    } else if (strncmp(line, "UNPIVOT ", 8) == 0) {
+        const char *args = line + 8;
+        ROW row;
+        COL col;
+        append_string(client, parse_cell(&args, &row, &col) && *args == 0 && remove_pivot(row, col) ?
+                              "OK\n" : "ERR no pivot\n");
+    } else if (strcmp(line, "STATS") == 0) {
+        MemoryStats stats = get_memory_stats();
+        char reply[256];
+        snprintf(reply, sizeof(reply), "STATS %zu %zu %lu %lu %lu %lu %lu %lu %lu\n", stats.budget,
+                 stats.resident_bytes, stats.hits, stats.misses, stats.evictions, stats.reads, stats.writes,
+                 stats.bytes_read, stats.bytes_written);
+        append_string(client, reply);
+    } else if (strcmp(line, "SUB") == 0) {
+        client->subscribed = true;
+        append_string(client, "OK\nSHEET ");
+        append_string(client, sheet_name(active_sheet()));
+        append_string(client, "\n");
+    } else {
+        append_string(client, "ERR unknown request\n");
+    }
+}
+
+static void add_client(int fd) {
+    if (num_clients == clients_capacity) {
+        size_t capacity = clients_capacity == 0 ? 16 : clients_capacity * 2;
+        Client **grown = realloc(clients, capacity * sizeof(Client *));
+        if (grown == NULL) {
+            close(fd);
+            return;
+        }
+        clients = grown;
+        clients_capacity = capacity;
+    }
+    Client *client = calloc(1, sizeof(Client));
+    if (client == NULL) {
+        close(fd);
+        return;
+    }
+    client->fd = fd;
+    client->registered_events = EPOLLIN;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        free(client);
+        close(fd);
+        return;
+    }
+    clients[num_clients++] = client;
+}
+
+static void remove_client(size_t index) {
+    Client *client = clients[index];
+    close(client->fd); // Also removes it from the epoll set.
+    free(client->in);
+    free(client->out);
+    free(client);
+    clients[index] = clients[--num_clients];
+}
+
+static void accept_clients(int listen_fd) {
+    while (true) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        add_client(fd);
+    }
+}
+
+// Reads everything available and handles each complete line.
+static void read_client(Client *client) {
+    while (!client->closing) {
+        if (!reserve(&client->in, &client->in_capacity, client->in_length + MAX_LINE_LENGTH)) {
+            client->closing = true;
+            return;
+        }
+        ssize_t amount = read(client->fd, client->in + client->in_length, client->in_capacity - client->in_length);
+        if (amount == 0 || (amount < 0 && errno != EAGAIN && errno != EINTR)) {
+            client->closing = true;
+            break;
+        }
+        if (amount < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        client->in_length += amount;
+
+        // Handle every complete line, then keep the partial tail for later.
+        size_t start = 0;
+        for (size_t i = 0; i < client->in_length; i++) {
+            if (client->in[i] != '\n')
+                continue;
+            client->in[i] = 0;
+            if (i > start && client->in[i - 1] == '\r')
+                client->in[i - 1] = 0;
+            handle_line(client, client->in + start);
+            start = i + 1;
+        }
+        memmove(client->in, client->in + start, client->in_length - start);
+        client->in_length -= start;
+        if (client->in_length >= MAX_LINE_LENGTH) {
+            append_string(client, "ERR line too long\n");
+            client->closing = true;
+        }
+    }
+}
+
+// Writes as much queued output as the socket accepts. Returns false once the
+// client should be removed.
+static bool flush_client(Client *client) {
+    while (client->out_length > 0) {
+        ssize_t amount = write(client->fd, client->out, client->out_length);
+        if (amount < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return false;
+            break;
+        }
+        memmove(client->out, client->out + amount, client->out_length - amount);
+        client->out_length -= amount;
+    }
+    if (client->out_length == 0 && client->closing)
+        return false;
+
+    // Only wait for writability while output is pending, and stop reading once
+    // the peer is done so a half-closed socket does not wake us up forever.
+    uint32_t wanted = (client->closing ? 0 : EPOLLIN) | (client->out_length > 0 ? EPOLLOUT : 0);
+    if (wanted != client->registered_events) {
+        struct epoll_event event = {.events = wanted, .data.ptr = client};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+        client->registered_events = wanted;
+    }
+    return true;
+}
+
+static int open_listener(const char *path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    const char *path = DEFAULT_SOCKET_PATH;
+    const char *journal_path = NULL;
+    unsigned commit_interval_ms = 10;
+    unsigned long checkpoint_records = 100000;
+    size_t memory_budget = 0;
+    int option;
+    while ((option = getopt(argc, argv, "s:j:i:k:m:")) != -1) {
+        switch (option) {
+            case 's':
+                path = optarg;
+                break;
+            case 'j':
+                journal_path = optarg;
+                break;
+            case 'i':
+                commit_interval_ms = (unsigned) atoi(optarg);
+                break;
+            case 'k':
+                checkpoint_records = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                memory_budget = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-s socket_path] [-j journal_path] [-i commit_interval_ms] [-k checkpoint_records]"
+                        " [-m memory_budget_bytes]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    model_init();
+    if (memory_budget > 0) {
+        // Cold sheets spill to a file beside the socket.
+        char spill_path[PATH_MAX];
+        snprintf(spill_path, sizeof(spill_path), "%s.spill", path);
+        if (!set_memory_budget(memory_budget, spill_path)) {
+            perror(spill_path);
+            return 1;
+        }
+    }
+    if (journal_path != NULL) {
+        long replayed = journal_open(journal_path, commit_interval_ms, checkpoint_records);
+        if (replayed < 0) {
+            perror(journal_path);
+            return 1;
+        }
+        fprintf(stderr, "Recovered %ld edits from %s\n", replayed, journal_path);
+    }
+
+    int listen_fd = open_listener(path);
+    if (listen_fd < 0)
+        return 1;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) < 0) {
+        perror("epoll");
+        return 1;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int status = 0;
+    while (running) {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            Client *client = events[i].data.ptr;
+            if (client == NULL)
+                accept_clients(listen_fd);
+            else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                read_client(client);
+        }
+
+        // Group commit: sync every edit made in this round with one write
+        // before any of them is acknowledged. Edits that cannot be synced are
+        // never acknowledged: the daemon stops without sending the replies.
+        if (journal_pending() && !journal_flush()) {
+            fprintf(stderr, "Failed to sync the journal; stopping\n");
+            status = 1;
+            break;
+        }
+
+        // Edits may have queued change notifications for any subscriber, so
+        // flush every client with pending output, not only the ones that woke.
+        for (size_t i = 0; i < num_clients;) {
+            if (flush_client(clients[i]))
+                i++;
+            else
+                remove_client(i);
+        }
+    }
+
+    while (num_clients > 0)
+        remove_client(num_clients - 1);
+    close(listen_fd);
+    unlink(path);
+    journal_close();
+    spill_close();
+    return status;
+}
+
+void update_cell_display(ROW row, COL col, const char *text) {
+    if (row < 0 || row >= NUM_ROWS || col < 0 || col >= NUM_COLS)
+        return;
+    char shown[DISPLAY_TEXT_SIZE];
+    snprintf(shown, sizeof(shown), "%s", text);
+    // Tabs and newlines would break the line-based replies.
+    for (char *c = shown; *c; c++)
+        if (*c == '\t' || *c == '\n' || *c == '\r')
+            *c = ' ';
+    // The model also redisplays cells whose text stayed the same.
+    if (strcmp(shown, display[row][col]) == 0)
+        return;
+    memcpy(display[row][col], shown, sizeof(shown));
+
+    for (size_t i = 0; i < num_clients; i++) {
+        Client *client = clients[i];
+        if (!client->subscribed || client->closing)
+            continue;
+        append_string(client, "CHG ");
+        append_cell_name(client, row, col);
+        append_string(client, " ");
+        append_string(client, display[row][col]);
+        append_string(client, "\n");
+    }
+}
@@ -0,0 +1,124 @@
+#include "snapshot.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Snapshot of each sheet returned to new readers.
+static _Atomic(Snapshot *) current[MAX_SHEETS];
+
+// Last version published for each sheet. Only touched by the writer.
+static unsigned long versions[MAX_SHEETS];
+
+// Size of a cache line on the machines this runs on.
+#define CACHE_LINE_SIZE 64
+
+// Snapshot a reader is holding (a hazard pointer), or NULL. Each slot fills a
+// cache line of its own, so readers announcing snapshots on different cores
+// do not write to the same line.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic(Snapshot *) snapshot;
+} HazardSlot;
+
+static HazardSlot held[MAX_SNAPSHOT_READERS];
+
+// Whether each reader slot has been claimed.
+static atomic_bool claimed[MAX_SNAPSHOT_READERS];
+
+// Replaced snapshots that may still be held by a reader. Only touched by the writer.
+static Snapshot *retired = NULL;
+
+int snapshot_register_reader() {
+    for (int i = 0; i < MAX_SNAPSHOT_READERS; i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&claimed[i], &expected, true))
+            return i;
+    }
+    return -1;
+}
+
+void snapshot_unregister_reader(int reader) {
+    atomic_store(&held[reader].snapshot, NULL);
+    atomic_store(&claimed[reader], false);
+}
+
+const Snapshot *snapshot_acquire(int reader, int sheet) {
+    if (sheet < 0 || sheet >= MAX_SHEETS)
+        return NULL;
+    Snapshot *snapshot;
+    // Announce the snapshot before using it, then check it was not replaced in
+    // the meantime; once announced, the writer will not free it.
+    do {
+        snapshot = atomic_load(&current[sheet]);
+        atomic_store(&held[reader].snapshot, snapshot);
+    } while (snapshot != atomic_load(&current[sheet]));
+    return snapshot;
+}
+
+void snapshot_release(int reader) {
+    atomic_store(&held[reader].snapshot, NULL);
+}
+
+Snapshot *snapshot_begin(int sheet) {
+    Snapshot *snapshot = malloc(sizeof(Snapshot));
+    if (snapshot == NULL) {
+        fprintf(stderr, "Memory allocation failed for snapshot\n");
+        exit(1);
+    }
+    snapshot->sheet = sheet;
+    snapshot->version = versions[sheet] + 1;
+    snapshot->next_retired = NULL;
+    return snapshot;
+}
+
+// Returns true if any reader is holding the snapshot.
+static bool is_held(const Snapshot *snapshot) {
+    for (int i = 0; i < MAX_SNAPSHOT_READERS; i++)
+        if (atomic_load(&held[i].snapshot) == snapshot)
+            return true;
+    return false;
+}
+
+// Returns true if two snapshots hold the same values. Unused values are 0.
+static bool same_values(const Snapshot *a, const Snapshot *b) {
+    return memcmp(a->values, b->values, sizeof(a->values)) == 0 &&
+           memcmp(a->has_value, b->has_value, sizeof(a->has_value)) == 0 &&
+           memcmp(a->errors, b->errors, sizeof(a->errors)) == 0;
+}
+
+// Replace the snapshot of a sheet and free the retired snapshots nobody can reach any more.
+static void publish(int sheet, Snapshot *snapshot) {
+    Snapshot *previous = atomic_exchange(&current[sheet], snapshot);
+    if (previous != NULL) {
+        previous->next_retired = retired;
+        retired = previous;
+    }
+
+    Snapshot **link = &retired;
+    while (*link != NULL) {
+        Snapshot *candidate = *link;
+        if (is_held(candidate)) {
+            link = &candidate->next_retired;
+        } else {
+            *link = candidate->next_retired;
+            free(candidate);
+        }
+    }
+}
+
+bool snapshot_commit(Snapshot *snapshot) {
+    // Only the writer replaces snapshots, so the current one cannot be freed while it is compared.
+    Snapshot *previous = atomic_load(&current[snapshot->sheet]);
+    if (previous != NULL && same_values(previous, snapshot)) {
+        free(snapshot);
+        return false;
+    }
+    versions[snapshot->sheet] = snapshot->version;
+    publish(snapshot->sheet, snapshot);
+    return true;
+}
+
+void snapshot_withdraw(int sheet) {
+    publish(sheet, NULL);
+}
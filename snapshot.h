@@ -0,0 +1,60 @@
+#ifndef ASSIGNMENT_SNAPSHOT_H
+#define ASSIGNMENT_SNAPSHOT_H
+
+#include <stdbool.h>
+
+#include "defs.h"
+#include "model.h"
+
+// Maximum number of reader threads that can hold snapshots at the same time.
+#define MAX_SNAPSHOT_READERS 64
+
+// An immutable copy of every cell value of one sheet as of one committed edit.
+//
+// Snapshots are published by the single thread that edits the model and can be
+// read from any number of other threads without locking. A snapshot stays valid
+// until the reader that acquired it releases it.
+//
+// Every sheet has its own snapshot, whichever sheet is active. An edit
+// publishes a new snapshot of each loaded sheet whose values it changed,
+// including sheets changed through formulas referring to the edited sheet.
+typedef struct Snapshot {
+    int sheet; // Index of the sheet in the workbook
+    unsigned long version; // Increases by one with every snapshot of the sheet
+    double values[NUM_ROWS][NUM_COLS]; // Number or last computed formula value
+    bool has_value[NUM_ROWS][NUM_COLS]; // False for text, blank and error cells
+    CELL_ERROR errors[NUM_ROWS][NUM_COLS]; // Error of a formula, or ERROR_NONE
+    struct Snapshot *next_retired; // Used by the writer to track replaced snapshots
+} Snapshot;
+
+// Claims a reader slot for the calling thread.
+//
+// Returns the slot to pass to the other reader functions, or -1 if all
+// MAX_SNAPSHOT_READERS slots are taken.
+int snapshot_register_reader();
+
+// Gives a reader slot back. The reader must not be holding a snapshot.
+void snapshot_unregister_reader(int reader);
+
+// Returns the most recently committed snapshot of a sheet and keeps it alive
+// until 'snapshot_release' is called for the same reader. A reader holds one
+// snapshot at a time. Never blocks. Returns NULL if the sheet does not exist
+// or has not been loaded yet.
+const Snapshot *snapshot_acquire(int reader, int sheet);
+
+// Releases the snapshot held by a reader.
+void snapshot_release(int reader);
+
+// Allocates the next version of a sheet for the writer to fill in.
+Snapshot *snapshot_begin(int sheet);
+
+// Publishes a snapshot filled in after 'snapshot_begin' and frees replaced
+// snapshots which are no longer held by any reader. A snapshot holding the
+// same values as the current one of its sheet is freed instead; returns
+// whether it was published.
+bool snapshot_commit(Snapshot *snapshot);
+
+// Removes the snapshot of a sheet that no longer exists, so readers get NULL.
+void snapshot_withdraw(int sheet);
+
+#endif //ASSIGNMENT_SNAPSHOT_H
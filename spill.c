@@ -0,0 +1,115 @@
+#include "spill.h"
+#include "diagnostics.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <io.h>
+static ssize_t pread(int fd, void *data, size_t length, off_t offset) {
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    return read(fd, data, length);
+}
+static ssize_t pwrite(int fd, const void *data, size_t length, off_t offset) {
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    return write(fd, data, length);
+}
+#define ftruncate _chsize
+#endif
+
+static int spill_fd = -1;
+static char *spill_path = NULL;
+static off_t spill_end = 0;
+static SpillCounters counters;
+
+bool spill_open(const char *path) {
+    spill_close();
+    spill_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (spill_fd < 0) {
+        diagnostic("Error: Failed to open spill file %s", path);
+        return false;
+    }
+    spill_path = strdup(path);
+    spill_end = 0;
+    memset(&counters, 0, sizeof(counters));
+    return true;
+}
+
+bool spill_is_open() {
+    return spill_fd >= 0;
+}
+
+bool spill_write(const void *data, size_t length, long *offset, size_t *capacity) {
+    if (spill_fd < 0)
+        return false;
+    // Blocks that grew move to the end of the file; their old space is left unused.
+    if (*offset < 0 || *capacity < length) {
+        *offset = (long) spill_end;
+        *capacity = length;
+        spill_end += (off_t) length;
+    }
+    const unsigned char *position = data;
+    off_t at = (off_t) *offset;
+    size_t remaining = length;
+    while (remaining > 0) {
+        ssize_t amount = pwrite(spill_fd, position, remaining, at);
+        if (amount <= 0) {
+            diagnostic("Error: Failed to write spill file %s", spill_path);
+            return false;
+        }
+        position += amount;
+        at += amount;
+        remaining -= amount;
+    }
+    counters.writes++;
+    counters.bytes_written += length;
+    return true;
+}
+
+bool spill_read(long offset, void *data, size_t length) {
+    if (spill_fd < 0)
+        return false;
+    unsigned char *position = data;
+    off_t at = (off_t) offset;
+    size_t remaining = length;
+    while (remaining > 0) {
+        ssize_t amount = pread(spill_fd, position, remaining, at);
+        if (amount <= 0) {
+            diagnostic("Error: Failed to read spill file %s", spill_path);
+            return false;
+        }
+        position += amount;
+        at += amount;
+        remaining -= amount;
+    }
+    counters.reads++;
+    counters.bytes_read += length;
+    return true;
+}
+
+void spill_clear() {
+    if (spill_fd >= 0 && ftruncate(spill_fd, 0) < 0)
+        diagnostic("Error: Failed to truncate spill file %s", spill_path);
+    spill_end = 0;
+    memset(&counters, 0, sizeof(counters));
+}
+
+void spill_close() {
+    if (spill_fd < 0)
+        return;
+    close(spill_fd);
+    spill_fd = -1;
+    remove(spill_path);
+    free(spill_path);
+    spill_path = NULL;
+}
+
+SpillCounters spill_counters() {
+    return counters;
+}
@@ -0,0 +1,41 @@
+#ifndef ASSIGNMENT_SPILL_H
+#define ASSIGNMENT_SPILL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Scratch file holding blocks of cell contents evicted from memory.
+//
+// A block is written at the end of the file, or over its previous copy if that
+// one has room, and read back when the model needs it again. The file is only
+// valid for the current process: it is truncated when opened and removed when
+// closed.
+
+// Creates or truncates the spill file at 'path'.
+bool spill_open(const char *path);
+
+bool spill_is_open();
+
+// Writes a block. '*offset' and '*capacity' describe the space the block had
+// before (an offset of -1 for none) and are updated if it had to move.
+bool spill_write(const void *data, size_t length, long *offset, size_t *capacity);
+
+// Reads 'length' bytes of the block at 'offset'.
+bool spill_read(long offset, void *data, size_t length);
+
+// Discards every block and resets the counters.
+void spill_clear();
+
+void spill_close();
+
+// I/O since the spill file was opened or cleared.
+typedef struct {
+    unsigned long reads;
+    unsigned long writes;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+} SpillCounters;
+
+SpillCounters spill_counters();
+
+#endif //ASSIGNMENT_SPILL_H
@@ -1,9 +1,640 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "diagnostics.h"
+#include "journal.h"
 #include "model.h"
+#include "snapshot.h"
+#include "spill.h"
 #include "testrunner.h"
 #include "tests.h"
 
+static void test_snapshots() {
+    int reader = snapshot_register_reader();
+    assert(reader >= 0);
+
+    const Snapshot *before = snapshot_acquire(reader, 0);
+    assert(before->has_value[ROW_2][COL_C] && before->values[ROW_2][COL_C] == 3.1 + 1.4 + 0.4);
+    assert(!before->has_value[ROW_3][COL_A]);
+
+    // Edits made while a snapshot is held do not change it.
+    set_cell_value(ROW_2, COL_A, strdup("2.4"));
+    assert_display_text(ROW_2, COL_C, "5.9");
+    assert(before->values[ROW_2][COL_A] == 1.4);
+    assert(before->values[ROW_2][COL_C] == 3.1 + 1.4 + 0.4);
+    unsigned long version = before->version;
+    snapshot_release(reader);
+
+    const Snapshot *after = snapshot_acquire(reader, 0);
+    assert(after->version > version);
+    assert(after->values[ROW_2][COL_A] == 2.4);
+    assert(after->values[ROW_2][COL_C] == 3.1 + 2.4 + 0.4);
+    snapshot_release(reader);
+
+    // Every sheet has its own snapshot, which edits to the sheets it refers to update.
+    int other = add_sheet("Other");
+    assert(activate_sheet(other));
+    set_cell_value(ROW_1, COL_A, strdup("=Sheet1!A2+1"));
+    const Snapshot *first = snapshot_acquire(reader, 0);
+    assert(first->sheet == 0 && first->values[ROW_2][COL_A] == 2.4);
+    snapshot_release(reader);
+    assert(activate_sheet(0));
+    set_cell_value(ROW_2, COL_A, strdup("5"));
+    const Snapshot *second = snapshot_acquire(reader, other);
+    assert(second->sheet == other && second->values[ROW_1][COL_A] == 6.0);
+    snapshot_release(reader);
+    model_init();
+    assert(snapshot_acquire(reader, other) == NULL);
+    snapshot_release(reader);
+
+    snapshot_unregister_reader(reader);
+}
+
+// Set once the edits of test_concurrent_snapshots are done, to stop its readers.
+static atomic_bool edits_done;
+
+// Reads snapshots until the edits are done; each must be consistent.
+static void *read_snapshots(void *argument) {
+    (void) argument;
+    int reader = snapshot_register_reader();
+    assert(reader >= 0);
+    unsigned long last_version = 0;
+    while (!atomic_load(&edits_done)) {
+        const Snapshot *snapshot = snapshot_acquire(reader, 0);
+        assert(snapshot != NULL && snapshot->version >= last_version);
+        assert(snapshot->values[ROW_1][COL_B] == snapshot->values[ROW_1][COL_A] + 1);
+        last_version = snapshot->version;
+        snapshot_release(reader);
+    }
+    snapshot_unregister_reader(reader);
+    return NULL;
+}
+
+static void test_concurrent_snapshots() {
+    model_init();
+    set_cell_value(ROW_1, COL_B, strdup("=A1+1"));
+    atomic_store(&edits_done, false);
+    pthread_t readers[4];
+    for (int i = 0; i < 4; i++) {
+        assert(pthread_create(&readers[i], NULL, read_snapshots, NULL) == 0);
+    }
+
+    // Readers only ever see whole edits, while replaced snapshots are freed.
+    char text[16];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(text, sizeof(text), "%d", i);
+        set_cell_value(ROW_1, COL_A, strdup(text));
+    }
+    atomic_store(&edits_done, true);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(readers[i], NULL);
+    }
+}
+
+static void test_structural_edits() {
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("3"));
+    set_cell_value(ROW_2, COL_A, strdup("1"));
+    set_cell_value(ROW_3, COL_A, strdup("2"));
+    set_cell_value(ROW_1, COL_B, strdup("=A1+A3"));
+    assert_display_text(ROW_1, COL_B, "5.0");
+
+    // Formulas keep pointing at the same cells and are shown at their new addresses.
+    assert(insert_row(ROW_2));
+    assert_edit_text(ROW_1, COL_B, "=A1+A4");
+    assert_edit_text(ROW_2, COL_A, "");
+    assert_display_text(ROW_2, COL_A, "");
+    assert_display_text(ROW_4, COL_A, "2.0");
+
+    assert(sort_rows(ROW_1, ROW_4, COL_A, true));
+    assert_display_text(ROW_1, COL_A, "1.0");
+    assert_display_text(ROW_2, COL_A, "2.0");
+    assert_display_text(ROW_3, COL_A, "3.0");
+    assert_display_text(ROW_4, COL_A, "");
+    assert_display_text(ROW_3, COL_B, "5.0");
+    assert_edit_text(ROW_3, COL_B, "=A3+A2");
+
+    assert(delete_row(ROW_2));
+    assert_edit_text(ROW_2, COL_B, "=A2+#REF!");
+    assert_display_text(ROW_2, COL_B, "#REF!");
+
+    assert(insert_col(COL_A));
+    assert_edit_text(ROW_2, COL_C, "=B2+#REF!");
+
+    // References to the blank line pushed off the sheet become #REF!.
+    set_cell_value(ROW_1, COL_A, strdup("=A10+1"));
+    set_cell_value(ROW_2, COL_A, strdup("=G1+1"));
+    assert(insert_row(ROW_1));
+    assert_edit_text(ROW_2, COL_A, "=#REF!+1");
+    set_cell_value(ROW_1, COL_A, strdup("100"));
+    assert_display_text(ROW_2, COL_A, "#REF!");
+    assert(insert_col(COL_A));
+    assert_edit_text(ROW_3, COL_B, "=#REF!+1");
+
+    // Rows cannot be pushed off the end of the sheet.
+    set_cell_value(ROW_10, COL_A, strdup("last"));
+    assert(!insert_row(ROW_1));
+}
+
+static void test_errors() {
+    model_init();
+    diagnostics_clear();
+
+    // Blank cells count as 0; text and invalid references are errors.
+    set_cell_value(ROW_1, COL_A, strdup("=B1+1"));
+    assert_display_text(ROW_1, COL_A, "1.0");
+    set_cell_value(ROW_1, COL_B, strdup("word"));
+    assert_display_text(ROW_1, COL_A, "#VALUE!");
+    set_cell_value(ROW_1, COL_C, strdup("=Z1"));
+    assert_display_text(ROW_1, COL_C, "#REF!");
+
+    // Errors pass through every formula that depends on them.
+    set_cell_value(ROW_2, COL_A, strdup("=A1+2"));
+    assert_display_text(ROW_2, COL_A, "#VALUE!");
+    set_cell_value(ROW_1, COL_B, strdup("4"));
+    assert_display_text(ROW_1, COL_A, "5.0");
+    assert_display_text(ROW_2, COL_A, "7.0");
+
+    set_cell_value(ROW_3, COL_A, strdup("=A3+1"));
+    assert_display_text(ROW_3, COL_A, "#CIRC!");
+
+    // Every cell of a cycle is an error, as is everything depending on it,
+    // until the cycle is broken.
+    set_cell_value(ROW_4, COL_A, strdup("=B4+1"));
+    set_cell_value(ROW_4, COL_C, strdup("=A4+1"));
+    set_cell_value(ROW_4, COL_B, strdup("=A4+1"));
+    assert_display_text(ROW_4, COL_A, "#CIRC!");
+    assert_display_text(ROW_4, COL_B, "#CIRC!");
+    assert_display_text(ROW_4, COL_C, "#CIRC!");
+    recalculate_all();
+    assert_display_text(ROW_4, COL_A, "#CIRC!");
+    assert_display_text(ROW_4, COL_C, "#CIRC!");
+    set_cell_value(ROW_4, COL_B, strdup("5"));
+    assert_display_text(ROW_4, COL_B, "5.0");
+    assert_display_text(ROW_4, COL_A, "6.0");
+    assert_display_text(ROW_4, COL_C, "7.0");
+    set_cell_value(ROW_4, COL_B, strdup("=A4+1"));
+    assert_display_text(ROW_4, COL_C, "#CIRC!");
+    clear_cell(ROW_4, COL_B);
+    assert_display_text(ROW_4, COL_A, "1.0");
+    assert_display_text(ROW_4, COL_C, "2.0");
+
+    // None of this is worth a diagnostic.
+    assert(diagnostics_count() == 0);
+}
+
+static void test_specialization() {
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("2"));
+    set_cell_value(ROW_1, COL_B, strdup("=A1"));
+    set_cell_value(ROW_1, COL_C, strdup("=A1+B1"));
+    set_cell_value(ROW_1, COL_D, strdup("=0.5+C1+0.25"));
+    set_cell_value(ROW_1, COL_E, strdup("=1+2"));
+    set_cell_value(ROW_1, COL_F, strdup("=A1+B1+C1+1"));
+    assert_display_text(ROW_1, COL_B, "2.0");
+    assert_display_text(ROW_1, COL_C, "4.0");
+    assert_display_text(ROW_1, COL_D, "4.8");
+    assert_display_text(ROW_1, COL_E, "3.0");
+    assert_display_text(ROW_1, COL_F, "9.0");
+    assert_edit_text(ROW_1, COL_D, "=0.5+C1+0.25");
+
+    // The generic interpreter agrees, and errors still pass through both.
+    set_formula_specialization(false);
+    set_cell_value(ROW_1, COL_A, strdup("3"));
+    assert_display_text(ROW_1, COL_C, "6.0");
+    assert_display_text(ROW_1, COL_F, "13.0");
+    set_formula_specialization(true);
+    set_cell_value(ROW_1, COL_A, strdup("text"));
+    assert_display_text(ROW_1, COL_B, "#VALUE!");
+    assert_display_text(ROW_1, COL_D, "#VALUE!");
+    assert_display_text(ROW_1, COL_E, "3.0");
+
+    // Both report the first error in the order of the references.
+    const char *mixed[][2] = {{"=B3+Z1", "#VALUE!"}, {"=Z1+B3", "#REF!"}, {"=B3+Z1+A3+A3", "#VALUE!"},
+                              {"=A4+B3", "#REF!"}, {"=B3+A4", "#VALUE!"}, {"=A3+Z1+1", "#REF!"}};
+    set_cell_value(ROW_3, COL_B, strdup("text"));
+    set_cell_value(ROW_4, COL_A, strdup("=Z9+0"));
+    for (int enabled = 1; enabled >= 0; enabled--) {
+        set_formula_specialization(enabled);
+        for (int i = 0; i < 6; i++) {
+            set_cell_value(ROW_5 + i, COL_C, strdup(mixed[i][0]));
+            assert_display_text(ROW_5 + i, COL_C, mixed[i][1]);
+        }
+    }
+    set_formula_specialization(true);
+
+    // Recalculating everything orders formulas by their references.
+    set_cell_value(ROW_1, COL_A, strdup("1"));
+    recalculate_all();
+    assert_display_text(ROW_1, COL_F, "5.0");
+    set_cell_value(ROW_2, COL_A, strdup("=B2"));
+    set_cell_value(ROW_2, COL_B, strdup("=A2"));
+    recalculate_all();
+    assert_display_text(ROW_2, COL_A, "#CIRC!");
+    assert_display_text(ROW_2, COL_B, "#CIRC!");
+}
+
+static void test_diagnostics() {
+    diagnostics_clear();
+    // Only a second's worth of messages is kept (two if the clock ticks over).
+    for (int i = 0; i < DIAGNOSTICS_PER_SECOND * 4; i++)
+        diagnostic("message %d", i);
+    assert(diagnostics_count() <= DIAGNOSTICS_PER_SECOND * 2);
+    assert(diagnostics_count() + diagnostics_dropped() == DIAGNOSTICS_PER_SECOND * 4);
+    assert(strcmp(diagnostics_get(0), "message 0") == 0);
+    diagnostics_clear();
+    assert(diagnostics_count() == 0 && diagnostics_dropped() == 0);
+}
+
+static void test_journal() {
+    const char *path = "testrunner.journal";
+    const char *snapshot_path = "testrunner.journal.snapshot";
+    remove(path);
+    remove(snapshot_path);
+
+    model_init();
+    assert(journal_open(path, 0, 0) == 0);
+    set_cell_value(ROW_5, COL_A, strdup("0.1"));
+    set_cell_value(ROW_5, COL_B, strdup("=A5+1"));
+    set_cell_value(ROW_5, COL_C, strdup("label"));
+    assert(journal_checkpoint());
+    set_cell_value(ROW_5, COL_A, strdup("2.5"));
+    clear_cell(ROW_5, COL_C);
+    assert(insert_row(ROW_1));
+    journal_close();
+
+    // A torn record at the end of the journal is ignored.
+    FILE *file = fopen(path, "ab");
+    assert(file != NULL);
+    fputs("torn", file);
+    fclose(file);
+
+    // Start over and recover the snapshot plus the three edits made after it.
+    model_init();
+    assert(journal_open(path, 0, 0) == 3);
+    assert_edit_text(ROW_6, COL_B, "=A6+1");
+    assert_display_text(ROW_6, COL_B, "3.5");
+    assert_edit_text(ROW_6, COL_C, "");
+    journal_close();
+
+    remove(path);
+    remove(snapshot_path);
+}
+
+static void test_workbooks() {
+    model_init();
+    int data = add_sheet("Data");
+    assert(data == 1 && sheet_count() == 2);
+    assert(add_sheet("Data") == -1 && add_sheet("bad name") == -1);
+    assert(activate_sheet(data));
+    set_cell_value(ROW_1, COL_A, strdup("2.5"));
+
+    assert(activate_sheet(0));
+    assert_display_text(ROW_1, COL_A, "");
+    set_cell_value(ROW_1, COL_A, strdup("=Data!A1+1"));
+    assert_display_text(ROW_1, COL_A, "3.5");
+    set_cell_value(ROW_1, COL_B, strdup("=Missing!A1"));
+    assert_display_text(ROW_1, COL_B, "#REF!");
+
+    // Edits on another sheet recalculate the formulas referring to it.
+    assert(activate_sheet(data));
+    assert_display_text(ROW_1, COL_A, "2.5");
+    set_cell_value(ROW_1, COL_A, strdup("4"));
+    assert(insert_row(ROW_1));
+    assert(activate_sheet(0));
+    assert_display_text(ROW_1, COL_A, "5.0");
+    assert_edit_text(ROW_1, COL_A, "=Data!A2+1");
+
+    // A loaded sheet replaced by one from a snapshot takes its pivots and scenarios with it.
+    int replaced = add_sheet("Replaced");
+    assert(activate_sheet(replaced));
+    set_cell_value(ROW_1, COL_A, strdup("x"));
+    set_cell_value(ROW_2, COL_A, strdup("=B2+1"));
+    PivotSpec spec = {ROW_1, ROW_1, COL_A, COL_B, PIVOT_COUNT, ROW_1, COL_D};
+    assert(add_pivot(&spec));
+    int scenario = fork_scenario(replaced);
+    assert(scenario >= 0 && set_scenario_input(scenario, ROW_2, COL_B, 1));
+    assert(activate_sheet(0));
+    assert(add_unloaded_sheet("Replaced") == replaced && !is_sheet_loaded(replaced));
+    PivotSpec specs[MAX_PIVOTS];
+    assert(get_sheet_pivots(replaced, specs, MAX_PIVOTS) == 0 && get_scenario_overlay_size(scenario) == -1);
+
+    // Sheets are only loaded from the snapshot when they are used.
+    const char *path = "testrunner.journal";
+    const char *snapshot_path = "testrunner.journal.snapshot";
+    remove(path);
+    remove(snapshot_path);
+    model_init();
+    assert(journal_open(path, 0, 0) == 0);
+    int inputs = add_sheet("Inputs");
+    int unused = add_sheet("Unused");
+    assert(activate_sheet(inputs));
+    set_cell_value(ROW_1, COL_A, strdup("7"));
+    assert(activate_sheet(unused));
+    set_cell_value(ROW_2, COL_B, strdup("kept"));
+    assert(activate_sheet(0));
+    set_cell_value(ROW_1, COL_A, strdup("=Inputs!A1+1"));
+    assert(journal_checkpoint());
+    journal_close();
+
+    model_init();
+    assert(journal_open(path, 0, 0) == 0);
+    assert(sheet_count() == 3 && active_sheet() == 0);
+    assert(is_sheet_loaded(inputs) && !is_sheet_loaded(unused));
+    assert_display_text(ROW_1, COL_A, "8.0");
+
+    // An unloaded sheet is carried over to the next snapshot as it is.
+    assert(journal_checkpoint());
+    journal_close();
+    model_init();
+    assert(journal_open(path, 0, 0) == 0);
+    assert(!is_sheet_loaded(unused));
+    assert(activate_sheet(unused) && is_sheet_loaded(unused));
+    assert_edit_text(ROW_2, COL_B, "kept");
+    journal_close();
+
+    // Rows moving on a loaded sheet move the cells referenced by unloaded ones.
+    // Sheets that do not refer to it stay unloaded.
+    model_init();
+    assert(journal_open(path, 0, 0) >= 0 && activate_sheet(0));
+    set_cell_value(ROW_2, COL_A, strdup("42"));
+    set_cell_value(ROW_3, COL_A, strdup("7"));
+    assert(activate_sheet(unused));
+    set_cell_value(ROW_1, COL_A, strdup("=Sheet1!A2+0"));
+    set_cell_value(ROW_2, COL_A, strdup("=Sheet1!A3+0"));
+    int apart = add_sheet("Apart");
+    assert(activate_sheet(apart));
+    set_cell_value(ROW_1, COL_A, strdup("=B1+1"));
+    assert(activate_sheet(0) && journal_checkpoint());
+    journal_close();
+    model_init();
+    assert(journal_open(path, 0, 0) == 0 && !is_sheet_loaded(unused));
+    assert(insert_row(ROW_1));
+    assert(is_sheet_loaded(unused) && !is_sheet_loaded(apart));
+    assert(activate_sheet(unused));
+    assert_display_text(ROW_1, COL_A, "42.0");
+    assert_edit_text(ROW_1, COL_A, "=Sheet1!A3+0");
+    assert(activate_sheet(0) && journal_checkpoint());
+    journal_close();
+    model_init();
+    assert(journal_open(path, 0, 0) == 0 && !is_sheet_loaded(unused));
+    assert(delete_row(ROW_4));
+    assert(is_sheet_loaded(unused) && !is_sheet_loaded(apart));
+    assert(activate_sheet(unused));
+    assert_display_text(ROW_1, COL_A, "42.0");
+    assert_display_text(ROW_2, COL_A, "#REF!");
+    journal_close();
+
+    remove(path);
+    remove(snapshot_path);
+}
+
+static void test_memory_budget() {
+    model_init();
+    set_cell_value(ROW_2, COL_A, strdup("2"));
+    int first = add_sheet("First");
+    int second = add_sheet("Second");
+    assert(activate_sheet(first));
+    set_cell_value(ROW_1, COL_A, strdup("a label long enough to be worth spilling"));
+    set_cell_value(ROW_1, COL_B, strdup("=Sheet1!A2+1"));
+    set_cell_value(ROW_1, COL_C, strdup("=Sheet1!A2+Sheet1!A2+Sheet1!A2"));
+    assert(activate_sheet(second));
+    set_cell_value(ROW_1, COL_A, strdup("another label"));
+    assert(activate_sheet(0));
+    set_cell_value(ROW_1, COL_A, strdup("=First!B1+First!C1"));
+    assert(get_memory_stats().resident_bytes > 0);
+
+    // Everything but the active sheet is spilled.
+    assert(set_memory_budget(1, "testrunner.spill"));
+    MemoryStats stats = get_memory_stats();
+    assert(stats.evictions == 2 && stats.writes == 2 && stats.misses == 0);
+
+    // Only the generic formula needs its sheet read back; it is spilled again
+    // afterwards without being rewritten.
+    set_cell_value(ROW_2, COL_A, strdup("5"));
+    assert_display_text(ROW_1, COL_A, "21.0");
+    stats = get_memory_stats();
+    assert(stats.misses == 1 && stats.evictions == 3 && stats.writes == 2 && stats.reads == 1);
+
+    assert(activate_sheet(second));
+    assert_edit_text(ROW_1, COL_A, "another label");
+    assert(activate_sheet(first));
+    assert_edit_text(ROW_1, COL_C, "=Sheet1!A2+Sheet1!A2+Sheet1!A2");
+    assert_display_text(ROW_1, COL_C, "15.0");
+    assert(get_memory_stats().misses == 3);
+
+    assert(set_memory_budget(0, NULL));
+    spill_close();
+}
+
+static void test_pivots() {
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("x"));
+    set_cell_value(ROW_1, COL_B, strdup("3"));
+    set_cell_value(ROW_2, COL_A, strdup("y"));
+    set_cell_value(ROW_2, COL_B, strdup("4"));
+    set_cell_value(ROW_3, COL_A, strdup("x"));
+    set_cell_value(ROW_3, COL_B, strdup("5"));
+    set_cell_value(ROW_4, COL_A, strdup("y"));
+    set_cell_value(ROW_4, COL_B, strdup("text"));
+    set_cell_value(ROW_5, COL_B, strdup("9"));
+    PivotSpec sum = {ROW_1, ROW_6, COL_A, COL_B, PIVOT_SUM, ROW_1, COL_D};
+    PivotSpec min = {ROW_1, ROW_6, COL_A, COL_B, PIVOT_MIN, ROW_1, COL_F};
+    assert(add_pivot(&sum) && add_pivot(&min));
+    assert_display_text(ROW_1, COL_D, "x");
+    assert_display_text(ROW_1, COL_E, "8.0");
+    assert_display_text(ROW_2, COL_D, "y");
+    assert_display_text(ROW_2, COL_E, "4.0");
+    assert_display_text(ROW_3, COL_D, "");
+    assert_display_text(ROW_1, COL_G, "3.0");
+
+    // Outputs may not overlap their range or each other.
+    PivotSpec overlapping = {ROW_1, ROW_6, COL_A, COL_B, PIVOT_COUNT, ROW_3, COL_B};
+    assert(!add_pivot(&overlapping));
+    overlapping.target_col = COL_E;
+    assert(!add_pivot(&overlapping));
+
+    // Edits update the groups they touch, and formulas reading the output.
+    set_cell_value(ROW_7, COL_C, strdup("=E1+2"));
+    set_cell_value(ROW_1, COL_B, strdup("10"));
+    assert_display_text(ROW_1, COL_E, "15.0");
+    assert_display_text(ROW_1, COL_G, "5.0");
+    assert_display_text(ROW_7, COL_C, "17.0");
+    set_cell_value(ROW_2, COL_B, strdup("=A2"));
+    assert_display_text(ROW_2, COL_E, "#VALUE!");
+
+    // Groups appear and disappear; numeric keys come first.
+    set_cell_value(ROW_5, COL_A, strdup("z"));
+    assert_display_text(ROW_3, COL_D, "z");
+    assert_display_text(ROW_3, COL_E, "9.0");
+    set_cell_value(ROW_1, COL_A, strdup("2"));
+    set_cell_value(ROW_3, COL_A, strdup("2"));
+    assert_display_text(ROW_1, COL_D, "2.0");
+    assert_display_text(ROW_1, COL_E, "15.0");
+    assert_display_text(ROW_2, COL_D, "y");
+    assert_display_text(ROW_3, COL_D, "z");
+    assert_display_text(ROW_4, COL_D, "");
+
+    // After a structural edit the range holds other rows.
+    assert(insert_row(ROW_1));
+    set_cell_value(ROW_1, COL_A, strdup("z"));
+    set_cell_value(ROW_1, COL_B, strdup("1"));
+    assert_display_text(ROW_3, COL_D, "z");
+    assert_display_text(ROW_3, COL_E, "10.0");
+    assert_display_text(ROW_3, COL_G, "1.0");
+    assert_display_text(ROW_4, COL_D, "");
+    assert(remove_pivot(ROW_1, COL_F) && !remove_pivot(ROW_1, COL_F));
+    assert_display_text(ROW_1, COL_F, "");
+
+    // Keys that come and go leave no stale groups behind.
+    char key[16];
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), i % 2 ? "k%d" : "%d", i + 100);
+        set_cell_value(ROW_1, COL_A, strdup(key));
+        snprintf(key, sizeof(key), i % 2 ? "k%d" : "%d.0", i + 100);
+        assert_display_text(ROW_2, COL_D, key);
+        assert_display_text(ROW_2, COL_E, "1.0");
+        assert_display_text(ROW_5, COL_D, "");
+    }
+    set_cell_value(ROW_1, COL_A, strdup("z"));
+    assert_display_text(ROW_2, COL_D, "y");
+    assert_display_text(ROW_3, COL_D, "z");
+    assert_display_text(ROW_3, COL_E, "10.0");
+    assert_display_text(ROW_4, COL_D, "");
+
+    // Pivots never write over cells the user filled.
+    set_cell_value(ROW_9, COL_G, strdup("precious"));
+    PivotSpec covering = {ROW_1, ROW_6, COL_A, COL_B, PIVOT_COUNT, ROW_1, COL_F};
+    assert(!add_pivot(&covering));
+    assert_display_text(ROW_9, COL_G, "precious");
+    set_cell_value(ROW_1, COL_E, strdup("999"));
+    set_cell_value(ROW_2, COL_B, strdup("20"));
+    assert_display_text(ROW_1, COL_E, "999.0");
+    set_cell_value(ROW_1, COL_A, strdup("a"));
+    assert_display_text(ROW_2, COL_D, "a");
+    assert_display_text(ROW_1, COL_E, "999.0");
+    clear_cell(ROW_1, COL_E);
+    set_cell_value(ROW_4, COL_B, strdup("6"));
+    assert_display_text(ROW_1, COL_E, "26.0");
+
+    // Pivots are journaled and saved with their sheet.
+    const char *path = "testrunner.journal";
+    const char *snapshot_path = "testrunner.journal.snapshot";
+    remove(path);
+    remove(snapshot_path);
+    model_init();
+    assert(journal_open(path, 0, 0) == 0);
+    int data = add_sheet("Data");
+    assert(activate_sheet(data));
+    set_cell_value(ROW_1, COL_A, strdup("x"));
+    set_cell_value(ROW_2, COL_A, strdup("x"));
+    PivotSpec count = {ROW_1, ROW_5, COL_A, COL_B, PIVOT_COUNT, ROW_1, COL_D};
+    assert(add_pivot(&count));
+    journal_close();
+    model_init();
+    assert(journal_open(path, 0, 0) == 5);
+    assert_display_text(ROW_1, COL_E, "2.0");
+    assert(journal_checkpoint());
+    journal_close();
+
+    model_init();
+    assert(journal_open(path, 0, 0) == 0);
+    assert(active_sheet() == data);
+    set_cell_value(ROW_3, COL_A, strdup("x"));
+    assert_display_text(ROW_1, COL_E, "3.0");
+    assert(activate_sheet(0) && journal_checkpoint());
+    journal_close();
+    model_init();
+    assert(journal_open(path, 0, 0) == 0 && !is_sheet_loaded(data));
+    assert(activate_sheet(data));
+    set_cell_value(ROW_4, COL_A, strdup("x"));
+    assert_display_text(ROW_1, COL_E, "4.0");
+
+    // A cell the user typed over the output is saved, and the pivot still leaves it alone.
+    set_cell_value(ROW_1, COL_E, strdup("mine"));
+    set_cell_value(ROW_5, COL_A, strdup("y"));
+    assert_display_text(ROW_2, COL_D, "y");
+    assert(journal_checkpoint());
+    journal_close();
+    model_init();
+    assert(journal_open(path, 0, 0) == 0);
+    set_cell_value(ROW_1, COL_A, strdup("y"));
+    assert_display_text(ROW_1, COL_E, "mine");
+    assert_display_text(ROW_2, COL_E, "2.0");
+    journal_close();
+
+    remove(path);
+    remove(snapshot_path);
+}
+
+static void assert_scenario_text(int scenario, int sheet, ROW row, COL col, const char *text) {
+    char *value = get_scenario_value(scenario, sheet, row, col);
+    assert(value != NULL && strcmp(value, text) == 0);
+    free(value);
+}
+
+static void test_scenarios() {
+    model_init();
+    set_cell_value(ROW_1, COL_A, strdup("1"));
+    set_cell_value(ROW_2, COL_A, strdup("2"));
+    set_cell_value(ROW_3, COL_A, strdup("label"));
+    set_cell_value(ROW_1, COL_B, strdup("=A1+A2"));
+    set_cell_value(ROW_1, COL_C, strdup("=B1+1"));
+    set_cell_value(ROW_1, COL_D, strdup("=A2+10"));
+    int summary = add_sheet("Summary");
+    assert(activate_sheet(summary));
+    set_cell_value(ROW_1, COL_A, strdup("=Sheet1!C1+Sheet1!D1"));
+    assert(activate_sheet(0));
+    assert(fork_scenario(5) == -1);
+
+    // Only the inputs and the formulas downstream of them get their own values.
+    int raised = fork_scenario(0);
+    int overridden = fork_scenario(0);
+    assert(set_scenario_input(raised, ROW_1, COL_A, 10));
+    assert(set_scenario_input(overridden, ROW_1, COL_B, 100));
+    evaluate_scenarios(4);
+    assert(get_scenario_overlay_size(raised) == 4);
+    assert_scenario_text(raised, 0, ROW_1, COL_C, "13.0");
+    assert_scenario_text(raised, 0, ROW_1, COL_D, "12.0");
+    assert_scenario_text(raised, summary, ROW_1, COL_A, "25.0");
+    assert_scenario_text(raised, 0, ROW_3, COL_A, "label");
+    assert_scenario_text(raised, 0, ROW_4, COL_A, "");
+    assert_scenario_text(overridden, 0, ROW_1, COL_A, "1.0");
+    assert_scenario_text(overridden, 0, ROW_1, COL_B, "100.0");
+    assert_scenario_text(overridden, summary, ROW_1, COL_A, "113.0");
+    assert_display_text(ROW_1, COL_B, "3.0");
+    assert_display_text(ROW_1, COL_C, "4.0");
+
+    // Scenarios follow edits of the workbook.
+    set_cell_value(ROW_2, COL_A, strdup("5"));
+    set_cell_value(ROW_1, COL_E, strdup("=F1"));
+    set_cell_value(ROW_1, COL_F, strdup("=E1+A1"));
+    assert_scenario_text(raised, 0, ROW_1, COL_C, "16.0");
+    assert_scenario_text(raised, summary, ROW_1, COL_A, "31.0");
+    assert_scenario_text(raised, 0, ROW_1, COL_F, "#CIRC!");
+    assert_scenario_text(raised, 0, ROW_1, COL_E, "#CIRC!");
+
+    // Many scenarios are evaluated at once.
+    int forks[16];
+    for (int i = 0; i < 16; i++) {
+        forks[i] = fork_scenario(0);
+        assert(set_scenario_input(forks[i], ROW_1, COL_A, i));
+    }
+    evaluate_scenarios(4);
+    for (int i = 0; i < 16; i++) {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "%d.0", i + 6);
+        assert_scenario_text(forks[i], 0, ROW_1, COL_C, expected);
+        free_scenario(forks[i]);
+    }
+    free_scenario(raised);
+    assert(get_scenario_value(raised, 0, ROW_1, COL_A) == NULL);
+}
+
 void run_tests() {
     set_cell_value(ROW_2, COL_A, strdup("1.4"));
     assert_display_text(ROW_2, COL_A, strdup("1.4"));
@@ -14,4 +645,16 @@ void run_tests() {
     assert_display_text(ROW_2, COL_C, strdup("4.7"));
     set_cell_value(ROW_2, COL_B, strdup("3.1"));
     assert_display_text(ROW_2, COL_C, strdup("4.9"));
+
+    test_snapshots();
+    test_concurrent_snapshots();
+    test_structural_edits();
+    test_errors();
+    test_specialization();
+    test_diagnostics();
+    test_journal();
+    test_workbooks();
+    test_memory_budget();
+    test_pivots();
+    test_scenarios();
 }